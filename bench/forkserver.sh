@@ -0,0 +1,40 @@
+#!/bin/sh
+# Sends SIGUSR1 to a fork server part way through its queue. The scripts
+# after it must still run, the failing one must count, and the metrics
+# must be written.
+#
+# usage: ./forkserver.sh [nlisp]
+
+NLISP=${1:-./nlisp}
+dir=gen/forkserver
+rm -rf "$dir"
+mkdir -p "$dir"
+
+printf '(print "one")\n' > "$dir/one.lspy"
+printf '(print "two")\n' > "$dir/two.lspy"
+printf '(print "before")\n(undefined-symbol)\n' > "$dir/bad.lspy"
+mkfifo "$dir/queue"
+
+# A server that stops reading early must fail the check, not kill it
+trap '' PIPE
+
+"$NLISP" --metrics "$dir/metrics.prom" --fork-server 1 < "$dir/queue" > "$dir/out.txt" 2>&1 &
+pid=$!
+exec 3> "$dir/queue"
+echo "$dir/one.lspy" >&3
+sleep 1
+kill -USR1 $pid
+sleep 1
+echo "$dir/two.lspy" >&3 2>/dev/null
+echo "$dir/bad.lspy" >&3 2>/dev/null
+exec 3>&-
+wait $pid
+status=$?
+
+cat "$dir/out.txt"
+failed=0
+grep -q '"two"' "$dir/out.txt" || { echo "FAIL script after SIGUSR1 did not run"; failed=1; }
+grep -q 'undefined-symbol' "$dir/out.txt" || { echo "FAIL failing script did not run"; failed=1; }
+[ "$status" = 1 ] || { echo "FAIL exit status $status, expected 1"; failed=1; }
+[ -s "$dir/metrics.prom" ] || { echo "FAIL no metrics written"; failed=1; }
+exit $failed
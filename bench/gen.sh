@@ -0,0 +1,47 @@
+#!/bin/sh
+# Writes the generated inputs for the suite into gen/.
+# Everything comes from fixed seeds, with arithmetic exact in any awk, so every
+# run reads the same bytes.
+
+set -e
+mkdir -p gen
+
+# g0 ... g4999, defined after the prelude for lookup.lspy
+awk 'BEGIN { for (i = 0; i < 5000; i++) printf "(def {g%d} %d)\n", i, i }' > gen/globals.lspy
+
+# s0 ... s299 three times over, for the interned symbol table of serialize
+awk 'BEGIN { printf "(def {syms} {"; for (i = 0; i < 900; i++) printf "%ss%d", i ? " " : "", i % 300; print "})" }' > gen/symbols.lspy
+
+# Q-Expressions of numbers, strings, symbols and comments, about size bytes in all
+source()
+{
+  awk -v size="$2" -v seed="$3" '
+    function rnd(n) { seed = (seed * 16807) % 2147483647; return seed % n }
+    function atom(  k) {
+      k = rnd(4)
+      if (k == 0) return rnd(100000) - 50000
+      if (k == 1) return "\"str " rnd(1000) " \\\"q\\\"\""
+      if (k == 2) return "sym-" rnd(500)
+      return "+"
+    }
+    function form(depth,  s, n, i) {
+      n = 2 + rnd(6)
+      s = "{"
+      for (i = 0; i < n; i++) {
+        if (i) s = s " "
+        s = s (depth < 3 && rnd(4) == 0 ? form(depth + 1) : atom())
+      }
+      return s "}"
+    }
+    BEGIN {
+      total = 0
+      while (total < size) {
+        line = (rnd(8) == 0 ? "; comment " rnd(1000) "\n" : "") form(0) "\n"
+        printf "%s", line
+        total += length(line)
+      }
+    }' > "$1"
+}
+
+source gen/source-256kb.lspy 262144 256
+source gen/source-1mb.lspy 1048576 1024
@@ -0,0 +1,50 @@
+#!/bin/sh
+# Saves images and serialized values in one process and uses them in
+# another, which has to find everything they refer to in them.
+#
+# usage: ./image.sh [nlisp]
+
+NLISP=${1:-./nlisp}
+dir=gen/image
+rm -rf "$dir"
+mkdir -p "$dir/m"
+
+# api is required on its own and calls helper, which stays in the module
+cat > "$dir/m/lib.lspy" <<'LSPY'
+(def {secret} 41)
+(fun {helper x} {+ x secret})
+(fun {api x} {helper x})
+LSPY
+printf '(require "%s/m/lib.lspy" {api})\n(serialize api "%s/api.bin")\n' "$dir" "$dir" > "$dir/save.lspy"
+
+failed=0
+# check name expected-output nlisp-arguments...
+check()
+{
+  name=$1
+  expect=$2
+  shift 2
+  out=$("$NLISP" --no-cache "$@" 2>&1 | grep -v '^Error: [^ ]*prelude.lspy:[78]:')
+  if [ "$out" = "$expect" ]; then
+    echo "ok $name"
+  else
+    echo "FAIL $name: expected '$expect', got '$out'"
+    failed=1
+  fi
+}
+
+"$NLISP" --no-cache ../prelude.lspy "$dir/save.lspy" --save-image "$dir/module.img" > /dev/null 2>&1
+printf '(print (api 1))\n' > "$dir/call.lspy"
+check "image of a required function" "42 " --load-image "$dir/module.img" "$dir/call.lspy"
+printf '(print ((deserialize "%s/api.bin") 2))\n' "$dir" > "$dir/deserialize.lspy"
+check "deserialized required function" "43 " ../prelude.lspy "$dir/deserialize.lspy"
+
+# A module required before --load-image belongs to the environment it replaces
+printf '(def {base} 1)\n(require "%s/m/base.lspy" {plus})\n' "$dir" > "$dir/before.lspy"
+printf '(fun {plus x} {+ x base})\n' > "$dir/m/base.lspy"
+printf '(def {base} 100)\n' > "$dir/base.lspy"
+"$NLISP" --no-cache ../prelude.lspy "$dir/base.lspy" --save-image "$dir/base.img" > /dev/null 2>&1
+printf '(require "%s/m/base.lspy" {plus})\n(print (plus 1))\n' "$dir" > "$dir/after.lspy"
+check "module required again after an image" "101 " ../prelude.lspy "$dir/before.lspy" --load-image "$dir/base.img" "$dir/after.lspy"
+
+exit $failed
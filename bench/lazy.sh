@@ -0,0 +1,44 @@
+#!/bin/sh
+# Loads files with --lazy and checks they end up defining what an eager
+# load would.
+#
+# usage: ./lazy.sh [nlisp]
+
+NLISP=${1:-./nlisp}
+dir=gen/lazy
+rm -rf "$dir"
+mkdir -p "$dir"
+
+failed=0
+# check name expected-output nlisp-arguments...
+check()
+{
+  name=$1
+  expect=$2
+  shift 2
+  out=$("$NLISP" --no-cache "$@" 2>&1)
+  if [ "$out" = "$expect" ]; then
+    echo "ok $name"
+  else
+    echo "FAIL $name: expected '$expect', got '$out'"
+    failed=1
+  fi
+}
+
+# z is deferred, then redefined in terms of itself
+printf '(def {z} 1)\n(def {z} (+ z 1))\n' > "$dir/redef.lspy"
+printf '(print z)\n' > "$dir/z.lspy"
+check "eager redefinition" "2 " "$dir/redef.lspy" "$dir/z.lspy"
+check "lazy redefinition" "2 " --lazy "$dir/redef.lspy" "$dir/z.lspy"
+
+# y is deferred, then set directly before the image or module has it
+printf '(def {y} 1)\n' > "$dir/y.lspy"
+printf '(= {y} 2)\n' > "$dir/set.lspy"
+printf '(print y)\n' > "$dir/print.lspy"
+"$NLISP" --no-cache --lazy "$dir/y.lspy" "$dir/set.lspy" --save-image "$dir/y.img" > /dev/null 2>&1
+check "image of a set lazy name" "2 " --load-image "$dir/y.img" "$dir/print.lspy"
+cat "$dir/y.lspy" "$dir/set.lspy" > "$dir/m.lspy"
+printf '(require "%s/m.lspy")\n(print y)\n' "$dir" > "$dir/require.lspy"
+check "module with a set lazy name" "2 " --lazy "$dir/require.lspy"
+
+exit $failed
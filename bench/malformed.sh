@@ -0,0 +1,81 @@
+#!/bin/sh
+# Feeds deserialize and --load-image lambdas that \ could never have
+# made. Each must be refused as not a serialized value, without crashing.
+#
+# usage: ./malformed.sh [nlisp]
+
+NLISP=${1:-./nlisp}
+dir=gen/malformed
+rm -rf "$dir"
+mkdir -p "$dir"
+
+# Write the bytes given in hex to a file
+bytes()
+{
+  out=$1
+  shift
+  for h in "$@"; do
+    printf "\\$(printf '%03o' "0x$h")"
+  done > "$out"
+}
+
+# BIN_VERSION in not-lisp.c, which these bytes must follow
+version=05
+
+# The symbol table x, lam.lspy, "" and &, then after it a lambda from \
+# with the given formals and body and no module. {x} is 07 02 followed by
+# x and its span
+syms="08 02 78 10 6c 61 6d 2e 6c 73 70 79 00 02 26"
+x="03 00 02 02 20"
+lambda()
+{
+  echo "04 00 00 $1 $2 04 02 02 02 00"
+}
+good=$(lambda "07 02 $x 02 02 1e" "07 02 $x 02 02 28")
+
+value()
+{
+  bytes "$dir/$1.bin" 4e 4c 53 50 56 00 $version $syms $2
+}
+image()
+{
+  bytes "$dir/$1.img" 4e 4c 53 50 49 4d 47 00 $version $syms 02 00 $2
+}
+
+value good "$good"
+value num-formal "$(lambda "07 02 01 0a 02 02 1e" "07 02 $x 02 02 28")"
+value num-formals "$(lambda "01 0a" "07 02 $x 02 02 28")"
+value misplaced-rest "$(lambda "07 06 03 06 02 02 20 $x $x 02 02 1e" "07 02 $x 02 02 28")"
+value num-body "$(lambda "07 02 $x 02 02 1e" "01 0a")"
+image good "$good"
+image num-formal "$(lambda "07 02 01 0a 02 02 1e" "07 02 $x 02 02 28")"
+
+failed=0
+check()
+{
+  printf '%s\n' "$2" > "$dir/run.lspy"
+  shift 2
+  "$NLISP" --no-cache "$@" "$dir/run.lspy" > "$dir/out.txt" 2>&1
+  status=$?
+  if [ $status -ge 128 ] || ! grep -q "$expect" "$dir/out.txt"; then
+    echo "FAIL $name (status $status)"
+    cat "$dir/out.txt"
+    failed=1
+  else
+    echo "ok $name"
+  fi
+}
+
+name="good value"; expect="^1 $"
+check "$name" "(print ((deserialize \"$dir/good.bin\") 1))"
+for bad in num-formal num-formals misplaced-rest num-body; do
+  name=$bad; expect="Not a serialized value"
+  check "$name" "(print ((deserialize \"$dir/$bad.bin\") 1))"
+done
+# An image holds only what it was saved with, so x is called wrongly on purpose
+name="good image"; expect="Got 2, Expected 1"
+check "$name" "(x 1 2)" --load-image "$dir/good.img"
+name="image num-formal"; expect="Could not load image"
+check "$name" "(x 1 2)" --load-image "$dir/num-formal.img"
+
+exit $failed
@@ -0,0 +1,60 @@
+#!/bin/sh
+# Runs each workload through `nlisp --bench` and prints a line per benchmark:
+# runs per second, median time, allocations per run and the peak RSS of the
+# process that ran it. Given a results file from an earlier run, it also prints
+# how many times faster each benchmark is than it was there.
+#
+# usage: ./run.sh [nlisp] [baseline.txt]
+
+NLISP=${1:-./nlisp}
+BASELINE=${2:-/dev/null}
+WORKLOADS="fib lists closures lookup parse serialize"
+
+[ -f gen/globals.lspy ] || ./gen.sh || exit 1
+
+status=0
+printf '%-34s%12s%12s%12s%12s%10s%s\n' benchmark ops/sec median-ms allocs/run peak-rss-kb MB/s \
+  "$([ "$BASELINE" != /dev/null ] && printf '%10s' baseline)"
+
+for w in $WORKLOADS; do
+  # --no-cache so the parser workload reads its sources every time
+  "$NLISP" --no-cache ../prelude.lspy --bench "$w.lspy" 2>/dev/null > "gen/$w.json"
+  awk -v baseline="$BASELINE" -v workload="$w" '
+    BEGIN {
+      while ((getline line < baseline) > 0) {
+        if (line ~ /^benchmark/) continue
+        name = substr(line, 1, 34); sub(/ +$/, "", name)
+        split(substr(line, 35), f, " ")
+        base[name] = f[1]
+      }
+    }
+    function field(s, key,  v) {
+      if (!match(s, "\"" key "\": [0-9]+")) return 0
+      v = substr(s, RSTART, RLENGTH); sub(/.*: /, "", v)
+      return v + 0
+    }
+    /"error":/ { print workload ": " $0 > "/dev/stderr"; failed = 1; next }
+    /"peak_rss_kb":/ { rss = field($0, "peak_rss_kb") }
+    /\{"name":/ {
+      match($0, /"name": "[^"]*"/)
+      name = substr($0, RSTART + 9, RLENGTH - 10)
+      median = field($0, "median_ns")
+      ops = median ? 1e9 / median : 0
+      # Loads of a file also report how fast it was read
+      mbs = "-"
+      if (name ~ /^load /) {
+        file = substr(name, 6); bytes = 0
+        cmd = "wc -c < \"" file "\""; cmd | getline bytes; close(cmd)
+        mbs = sprintf("%.3f", bytes * ops / 1048576)
+      }
+      row = sprintf("%-34s%12.2f%12.3f%12d%12d%10s", name, ops, median / 1e6,
+                    field($0, "allocs_per_run"), rss, mbs)
+      if (name in base && base[name] > 0) row = row sprintf("%9.2fx", ops / base[name])
+      print row
+      seen = 1
+    }
+    END { exit (failed || !seen) }
+  ' "gen/$w.json" || status=1
+done
+
+exit $status
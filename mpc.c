@@ -1,5 +1,25 @@
 #include "mpc.h"
 
+/*
+** Static Probes
+**
+** Built with MPC_PROBES, where <sys/sdt.h> is
+** available, mpc_parse_input marks the start and
+** end of each parse for bpftrace, perf and
+** SystemTap as mpc:parse-start and mpc:parse-done.
+** Each is a nop until a tracer attaches, and
+** without MPC_PROBES they compile to nothing.
+*/
+
+#ifdef MPC_PROBES
+#include <sys/sdt.h>
+#define MPC_PROBE2(name, a, b) DTRACE_PROBE2(mpc, name, a, b)
+#define MPC_PROBE3(name, a, b, c) DTRACE_PROBE3(mpc, name, a, b, c)
+#else
+#define MPC_PROBE2(name, a, b)
+#define MPC_PROBE3(name, a, b, c)
+#endif
+
 /*
 ** State Type
 */
@@ -65,13 +85,37 @@ enum {
   MPC_INPUT_MARKS_MIN = 32
 };
 
+/*
+** Small allocations made while parsing come
+** from a pool owned by the input. Requests are
+** rounded up to one of a few size classes and
+** each class hands out slots from a free list,
+** or failing that by bumping through a region.
+**
+** The first region of every class is carved out
+** of one block sized from the length of the
+** input. When a class runs dry it gets a new
+** slab twice the size of the last one, so big
+** inputs do not keep falling back to malloc.
+*/
+
 enum {
-  MPC_INPUT_MEM_NUM = 512
+  MPC_INPUT_MEM_CLASSES = 4,
+  MPC_INPUT_MEM_MIN     = 64,
+  MPC_INPUT_MEM_MAX     = 4096,
+  MPC_INPUT_MEM_RATIO   = 64
 };
 
-typedef struct {
-  char mem[64];
-} mpc_mem_t;
+static const size_t mpc_mem_class_size[MPC_INPUT_MEM_CLASSES] = { 16, 32, 64, 128 };
+
+typedef struct mpc_mem_slab_t {
+  struct mpc_mem_slab_t *next;
+  char *start;
+  char *end;
+  int cls;
+} mpc_mem_slab_t;
+
+static mpc_mem_stats_t mpc_mem_stats_total = { 0, 0, 0 };
 
 typedef struct {
 
@@ -92,12 +136,53 @@ typedef struct {
   char *lasts;
   char last;
   
-  size_t mem_index;
-  char mem_full[MPC_INPUT_MEM_NUM];
-  mpc_mem_t mem[MPC_INPUT_MEM_NUM];
+  char *mem;
+  char *mem_bounds[MPC_INPUT_MEM_CLASSES+1];
+  char *mem_bump[MPC_INPUT_MEM_CLASSES];
+  char *mem_bump_end[MPC_INPUT_MEM_CLASSES];
+  void *mem_free[MPC_INPUT_MEM_CLASSES];
+  size_t mem_slots[MPC_INPUT_MEM_CLASSES];
+  mpc_mem_slab_t *mem_slabs;
   
 } mpc_input_t;
 
+static void mpc_input_mem_init(mpc_input_t *i, size_t length) {
+  
+  int c;
+  char *p;
+  size_t total = 0;
+  size_t slots = length / MPC_INPUT_MEM_RATIO;
+  
+  if (slots < MPC_INPUT_MEM_MIN) { slots = MPC_INPUT_MEM_MIN; }
+  if (slots > MPC_INPUT_MEM_MAX) { slots = MPC_INPUT_MEM_MAX; }
+  
+  for (c = 0; c < MPC_INPUT_MEM_CLASSES; c++) {
+    total += slots * mpc_mem_class_size[c];
+  }
+  
+  i->mem = malloc(total);
+  p = i->mem;
+  for (c = 0; c < MPC_INPUT_MEM_CLASSES; c++) {
+    i->mem_bounds[c] = p;
+    i->mem_bump[c] = p;
+    p += slots * mpc_mem_class_size[c];
+    i->mem_bump_end[c] = p;
+    i->mem_free[c] = NULL;
+    i->mem_slots[c] = slots * 2;
+  }
+  i->mem_bounds[MPC_INPUT_MEM_CLASSES] = p;
+  i->mem_slabs = NULL;
+}
+
+static size_t mpc_input_file_length(FILE *f) {
+  long pos = ftell(f);
+  long end;
+  if (pos < 0 || fseek(f, 0, SEEK_END) != 0) { return 0; }
+  end = ftell(f);
+  fseek(f, pos, SEEK_SET);
+  return end > pos ? (size_t)(end - pos) : 0;
+}
+
 static mpc_input_t *mpc_input_new_string(const char *filename, const char *string) {
 
   mpc_input_t *i = malloc(sizeof(mpc_input_t));
@@ -121,8 +206,7 @@ static mpc_input_t *mpc_input_new_string(const char *filename, const char *strin
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
   
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  mpc_input_mem_init(i, strlen(string));
   
   return i;
 }
@@ -151,8 +235,7 @@ static mpc_input_t *mpc_input_new_nstring(const char *filename, const char *stri
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
   
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  mpc_input_mem_init(i, length);
   
   return i;
 
@@ -180,8 +263,7 @@ static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
   
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  mpc_input_mem_init(i, 0);
   
   return i;
   
@@ -208,48 +290,102 @@ static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
   
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  mpc_input_mem_init(i, mpc_input_file_length(file));
   
   return i;
 }
 
 static void mpc_input_delete(mpc_input_t *i) {
   
+  mpc_mem_slab_t *m = i->mem_slabs;
+  mpc_mem_slab_t *n;
+  
   free(i->filename);
   
   if (i->type == MPC_INPUT_STRING) { free(i->string); }
   if (i->type == MPC_INPUT_PIPE) { free(i->buffer); }
   
+  free(i->mem);
+  while (m) {
+    n = m->next;
+    free(m);
+    m = n;
+  }
+  
   free(i->marks);
   free(i->lasts);
   free(i);
 }
 
+static int mpc_mem_class(size_t n) {
+  int c;
+  for (c = 0; c < MPC_INPUT_MEM_CLASSES; c++) {
+    if (n <= mpc_mem_class_size[c]) { return c; }
+  }
+  return -1;
+}
+
+/* Size class of a pool pointer or -1 for anything else */
 static int mpc_mem_ptr(mpc_input_t *i, void *p) {
-  return
-    (char*)p >= (char*)(i->mem) &&
-    (char*)p <  (char*)(i->mem) + (MPC_INPUT_MEM_NUM * sizeof(mpc_mem_t));
+  
+  int c;
+  mpc_mem_slab_t *m;
+  
+  if ((char*)p >= i->mem && (char*)p < i->mem_bounds[MPC_INPUT_MEM_CLASSES]) {
+    for (c = 1; c < MPC_INPUT_MEM_CLASSES; c++) {
+      if ((char*)p < i->mem_bounds[c]) { break; }
+    }
+    return c-1;
+  }
+  
+  for (m = i->mem_slabs; m; m = m->next) {
+    if ((char*)p >= m->start && (char*)p < m->end) { return m->cls; }
+  }
+  
+  return -1;
+}
+
+static void mpc_mem_grow(mpc_input_t *i, int c) {
+  
+  size_t size = i->mem_slots[c] * mpc_mem_class_size[c];
+  size_t head = (sizeof(mpc_mem_slab_t) + 15) / 16 * 16;
+  mpc_mem_slab_t *m = malloc(head + size);
+  
+  m->start = (char*)m + head;
+  m->end = m->start + size;
+  m->cls = c;
+  m->next = i->mem_slabs;
+  i->mem_slabs = m;
+  
+  i->mem_bump[c] = m->start;
+  i->mem_bump_end[c] = m->end;
+  i->mem_slots[c] *= 2;
+  mpc_mem_stats_total.grows++;
 }
 
 static void *mpc_malloc(mpc_input_t *i, size_t n) {
-  size_t j;
-  char *p;
   
-  if (n > sizeof(mpc_mem_t)) { return malloc(n); }
+  void *p;
+  int c = mpc_mem_class(n);
   
-  j = i->mem_index;
-  do {
-    if (!i->mem_full[i->mem_index]) {
-      p = (void*)(i->mem + i->mem_index);
-      i->mem_full[i->mem_index] = 1;
-      i->mem_index = (i->mem_index+1) % MPC_INPUT_MEM_NUM;
-      return p;
-    }
-    i->mem_index = (i->mem_index+1) % MPC_INPUT_MEM_NUM;
-  } while (j != i->mem_index);
+  if (c < 0) {
+    mpc_mem_stats_total.misses++;
+    return malloc(n);
+  }
   
-  return malloc(n);
+  mpc_mem_stats_total.hits++;
+  
+  if (i->mem_free[c]) {
+    p = i->mem_free[c];
+    i->mem_free[c] = *(void**)p;
+    return p;
+  }
+  
+  if (i->mem_bump[c] == i->mem_bump_end[c]) { mpc_mem_grow(i, c); }
+  
+  p = i->mem_bump[c];
+  i->mem_bump[c] += mpc_mem_class_size[c];
+  return p;
 }
 
 static void *mpc_calloc(mpc_input_t *i, size_t n, size_t m) {
@@ -258,23 +394,28 @@ static void *mpc_calloc(mpc_input_t *i, size_t n, size_t m) {
   return x;
 }
 
+static void mpc_mem_release(mpc_input_t *i, int c, void *p) {
+  *(void**)p = i->mem_free[c];
+  i->mem_free[c] = p;
+}
+
 static void mpc_free(mpc_input_t *i, void *p) {
-  size_t j;
-  if (!mpc_mem_ptr(i, p)) { free(p); return; }
-  j = ((size_t)(((char*)p) - ((char*)i->mem))) / sizeof(mpc_mem_t);
-  i->mem_full[j] = 0;
+  int c = mpc_mem_ptr(i, p);
+  if (c < 0) { free(p); return; }
+  mpc_mem_release(i, c, p);
 }
 
 static void *mpc_realloc(mpc_input_t *i, void *p, size_t n) {
   
   char *q = NULL;
+  int c = mpc_mem_ptr(i, p);
   
-  if (!mpc_mem_ptr(i, p)) { return realloc(p, n); }
+  if (c < 0) { return realloc(p, n); }
   
-  if (n > sizeof(mpc_mem_t)) {
-    q = malloc(n);
-    memcpy(q, p, sizeof(mpc_mem_t));
-    mpc_free(i, p);
+  if (n > mpc_mem_class_size[c]) {
+    q = mpc_malloc(i, n);
+    memcpy(q, p, mpc_mem_class_size[c]);
+    mpc_mem_release(i, c, p);
     return q;
   }
   
@@ -283,13 +424,18 @@ static void *mpc_realloc(mpc_input_t *i, void *p, size_t n) {
 
 static void *mpc_export(mpc_input_t *i, void *p) {
   char *q = NULL;
-  if (!mpc_mem_ptr(i, p)) { return p; }
-  q = malloc(sizeof(mpc_mem_t));
-  memcpy(q, p, sizeof(mpc_mem_t));
-  mpc_free(i, p);
+  int c = mpc_mem_ptr(i, p);
+  if (c < 0) { return p; }
+  q = malloc(mpc_mem_class_size[c]);
+  memcpy(q, p, mpc_mem_class_size[c]);
+  mpc_mem_release(i, c, p);
   return q; 
 }
 
+void mpc_mem_stats(mpc_mem_stats_t *s) {
+  *s = mpc_mem_stats_total;
+}
+
 static void mpc_input_backtrack_disable(mpc_input_t *i) { i->backtrack--; }
 static void mpc_input_backtrack_enable(mpc_input_t *i) { i->backtrack++; }
 
@@ -931,6 +1077,7 @@ struct mpc_parser_t {
   mpc_pdata_t data;
   char type;
   char retained;
+  int id;
 };
 
 static mpc_val_t *mpcf_input_nth_free(mpc_input_t *i, int n, mpc_val_t **xs, int x) {
@@ -1263,7 +1410,9 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
 
 int mpc_parse_input(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r) {
   int x;
-  mpc_err_t *e = mpc_err_fail(i, "Unknown Error");
+  mpc_err_t *e;
+  MPC_PROBE2(parse__start, i->filename, i->state.pos);
+  e = mpc_err_fail(i, "Unknown Error");
   e->state = mpc_state_invalid();
   x = mpc_parse_run(i, p, r, &e);
   if (x) {
@@ -1272,6 +1421,8 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r) {
   } else {
     r->error = mpc_err_export(i, mpc_err_merge(i, e, r->error));
   }
+  /* Where the input stopped, and whether it parsed */
+  MPC_PROBE3(parse__done, i->filename, i->state.pos, x);
   return x;
 }
 
@@ -1323,6 +1474,64 @@ int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r) {
   return res;
 }
 
+/*
+** Streaming
+*/
+
+/*
+** A stream keeps a single input alive across
+** several calls to the parser. Each call reads
+** just one `p` starting where the last call
+** finished, so a caller can consume a large
+** file one top-level item at a time without
+** ever holding the whole thing in memory.
+**
+** For pipes the backtracking buffer is only
+** kept while a parse is in progress, so the
+** memory used is bounded by the largest item.
+*/
+
+struct mpc_stream_t {
+  mpc_input_t *input;
+};
+
+static mpc_stream_t *mpc_stream_new(mpc_input_t *i) {
+  mpc_stream_t *s = malloc(sizeof(mpc_stream_t));
+  s->input = i;
+  return s;
+}
+
+mpc_stream_t *mpc_stream_file(const char *filename, FILE *file) {
+  return mpc_stream_new(mpc_input_new_file(filename, file));
+}
+
+mpc_stream_t *mpc_stream_pipe(const char *filename, FILE *pipe) {
+  return mpc_stream_new(mpc_input_new_pipe(filename, pipe));
+}
+
+static void mpc_stream_skip(mpc_stream_t *s) {
+  while (mpc_input_oneof(s->input, " \f\n\r\t\v", NULL));
+}
+
+int mpc_stream_done(mpc_stream_t *s) {
+  mpc_stream_skip(s);
+  return mpc_input_peekc(s->input) == '\0';
+}
+
+long mpc_stream_pos(mpc_stream_t *s) {
+  return s->input->state.pos;
+}
+
+int mpc_stream_next(mpc_stream_t *s, mpc_parser_t *p, mpc_result_t *r) {
+  mpc_stream_skip(s);
+  return mpc_parse_input(s->input, p, r);
+}
+
+void mpc_stream_delete(mpc_stream_t *s) {
+  mpc_input_delete(s->input);
+  free(s);
+}
+
 /*
 ** Building a Parser
 */
@@ -1452,6 +1661,7 @@ mpc_parser_t *mpc_copy(mpc_parser_t *a) {
   p->retained = a->retained;
   p->type = a->type;
   p->data = a->data;
+  p->id = a->id;
   
   if (a->name) {
     p->name = malloc(strlen(a->name)+1);
@@ -2781,6 +2991,154 @@ int mpc_test_pass(mpc_parser_t *p, const char *s, const void *d,
 }
 
 
+/*
+** AST Arena
+*/
+
+/*
+** When an arena is set every node, tag, contents
+** and children array is bump allocated out of it
+** rather than given its own `malloc`. Growing
+** the most recent allocation happens in place,
+** deleting a node does nothing and the whole
+** tree goes away when the arena is cleared.
+**
+** Clearing keeps the blocks around so the next
+** parse reuses the same memory.
+*/
+
+enum {
+  MPC_ARENA_BLOCK_SIZE = 65536
+};
+
+typedef union {
+  long l;
+  double d;
+  void *p;
+} mpc_arena_align_t;
+
+typedef struct mpc_arena_block_t {
+  struct mpc_arena_block_t *next;
+  size_t size;
+  size_t used;
+} mpc_arena_block_t;
+
+struct mpc_arena_t {
+  mpc_arena_block_t *first;
+  mpc_arena_block_t *curr;
+  char *last;
+};
+
+static mpc_arena_t *mpc_ast_arena_curr = NULL;
+
+static size_t mpc_arena_round(size_t n) {
+  size_t a = sizeof(mpc_arena_align_t);
+  return (n + a - 1) / a * a;
+}
+
+static char *mpc_arena_data(mpc_arena_block_t *b) {
+  return (char*)b + mpc_arena_round(sizeof(mpc_arena_block_t));
+}
+
+static mpc_arena_block_t *mpc_arena_block_new(size_t n) {
+  size_t size = n > MPC_ARENA_BLOCK_SIZE ? n : MPC_ARENA_BLOCK_SIZE;
+  mpc_arena_block_t *b = malloc(mpc_arena_round(sizeof(mpc_arena_block_t)) + size);
+  b->next = NULL;
+  b->size = size;
+  b->used = 0;
+  return b;
+}
+
+mpc_arena_t *mpc_arena_new(void) {
+  mpc_arena_t *a = malloc(sizeof(mpc_arena_t));
+  a->first = mpc_arena_block_new(MPC_ARENA_BLOCK_SIZE);
+  a->curr = a->first;
+  a->last = NULL;
+  return a;
+}
+
+void mpc_arena_clear(mpc_arena_t *a) {
+  a->curr = a->first;
+  a->curr->used = 0;
+  a->last = NULL;
+}
+
+void mpc_arena_delete(mpc_arena_t *a) {
+  mpc_arena_block_t *b = a->first;
+  mpc_arena_block_t *n;
+  while (b) {
+    n = b->next;
+    free(b);
+    b = n;
+  }
+  if (mpc_ast_arena_curr == a) { mpc_ast_arena_curr = NULL; }
+  free(a);
+}
+
+static void *mpc_arena_malloc(mpc_arena_t *a, size_t n) {
+  
+  mpc_arena_block_t *b;
+  
+  n = mpc_arena_round(n);
+  
+  /* Move on to the next block, reusing any left from before a clear */
+  while (a->curr->used + n > a->curr->size) {
+    if (a->curr->next && a->curr->next->size >= n) {
+      a->curr = a->curr->next;
+      a->curr->used = 0;
+    } else {
+      b = mpc_arena_block_new(n);
+      b->next = a->curr->next;
+      a->curr->next = b;
+      a->curr = b;
+    }
+  }
+  
+  a->last = mpc_arena_data(a->curr) + a->curr->used;
+  a->curr->used += n;
+  return a->last;
+}
+
+static void *mpc_arena_realloc(mpc_arena_t *a, void *p, size_t o, size_t n) {
+  
+  char *q;
+  size_t m;
+  
+  if (p == NULL) { return mpc_arena_malloc(a, n); }
+  
+  /* The most recent allocation can simply grow */
+  if (p == a->last) {
+    m = (size_t)(a->last - mpc_arena_data(a->curr));
+    if (m + mpc_arena_round(n) <= a->curr->size) {
+      a->curr->used = m + mpc_arena_round(n);
+      return p;
+    }
+  }
+  
+  q = mpc_arena_malloc(a, n);
+  memcpy(q, p, o < n ? o : n);
+  return q;
+}
+
+void mpc_ast_arena(mpc_arena_t *a) {
+  mpc_ast_arena_curr = a;
+}
+
+static void *mpc_ast_malloc(size_t n) {
+  if (mpc_ast_arena_curr) { return mpc_arena_malloc(mpc_ast_arena_curr, n); }
+  return malloc(n);
+}
+
+static void *mpc_ast_realloc(void *p, size_t o, size_t n) {
+  if (mpc_ast_arena_curr) { return mpc_arena_realloc(mpc_ast_arena_curr, p, o, n); }
+  return realloc(p, n);
+}
+
+static void mpc_ast_free(void *p) {
+  if (mpc_ast_arena_curr) { return; }
+  free(p);
+}
+
 /*
 ** AST
 */
@@ -2790,6 +3148,7 @@ void mpc_ast_delete(mpc_ast_t *a) {
   int i;
   
   if (a == NULL) { return; }
+  if (mpc_ast_arena_curr) { return; }
   
   for (i = 0; i < a->children_num; i++) {
     mpc_ast_delete(a->children[i]);
@@ -2803,23 +3162,24 @@ void mpc_ast_delete(mpc_ast_t *a) {
 }
 
 static void mpc_ast_delete_no_children(mpc_ast_t *a) {
-  free(a->children);
-  free(a->tag);
-  free(a->contents);
-  free(a);
+  mpc_ast_free(a->children);
+  mpc_ast_free(a->tag);
+  mpc_ast_free(a->contents);
+  mpc_ast_free(a);
 }
 
 mpc_ast_t *mpc_ast_new(const char *tag, const char *contents) {
   
-  mpc_ast_t *a = malloc(sizeof(mpc_ast_t));
+  mpc_ast_t *a = mpc_ast_malloc(sizeof(mpc_ast_t));
   
-  a->tag = malloc(strlen(tag) + 1);
+  a->tag = mpc_ast_malloc(strlen(tag) + 1);
   strcpy(a->tag, tag);
   
-  a->contents = malloc(strlen(contents) + 1);
+  a->contents = mpc_ast_malloc(strlen(contents) + 1);
   strcpy(a->contents, contents);
   
   a->state = mpc_state_new();
+  a->id = 0;
   
   a->children_num = 0;
   a->children = NULL;
@@ -2874,15 +3234,25 @@ int mpc_ast_eq(mpc_ast_t *a, mpc_ast_t *b) {
 }
 
 mpc_ast_t *mpc_ast_add_child(mpc_ast_t *r, mpc_ast_t *a) {
+  
+  int n = r->children_num;
+  
+  /* In an arena the children array doubles whenever it fills a power of two */
+  if (!mpc_ast_arena_curr) {
+    r->children = realloc(r->children, sizeof(mpc_ast_t*) * (n + 1));
+  } else if ((n & (n - 1)) == 0) {
+    r->children = mpc_ast_realloc(r->children,
+      sizeof(mpc_ast_t*) * n, sizeof(mpc_ast_t*) * (n ? n * 2 : 1));
+  }
+  
   r->children_num++;
-  r->children = realloc(r->children, sizeof(mpc_ast_t*) * r->children_num);
   r->children[r->children_num-1] = a;
   return r;
 }
 
 mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t) {
   if (a == NULL) { return a; }
-  a->tag = realloc(a->tag, strlen(t) + 1 + strlen(a->tag) + 1);
+  a->tag = mpc_ast_realloc(a->tag, strlen(a->tag) + 1, strlen(t) + 1 + strlen(a->tag) + 1);
   memmove(a->tag + strlen(t) + 1, a->tag, strlen(a->tag)+1);
   memmove(a->tag, t, strlen(t));
   memmove(a->tag + strlen(t), "|", 1);
@@ -2891,14 +3261,14 @@ mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t) {
 
 mpc_ast_t *mpc_ast_add_root_tag(mpc_ast_t *a, const char *t) {
   if (a == NULL) { return a; }
-  a->tag = realloc(a->tag, (strlen(t)-1) + strlen(a->tag) + 1);
+  a->tag = mpc_ast_realloc(a->tag, strlen(a->tag) + 1, (strlen(t)-1) + strlen(a->tag) + 1);
   memmove(a->tag + (strlen(t)-1), a->tag, strlen(a->tag)+1);
   memmove(a->tag, t, (strlen(t)-1));
   return a;
 }
 
 mpc_ast_t *mpc_ast_tag(mpc_ast_t *a, const char *t) {
-  a->tag = realloc(a->tag, strlen(t) + 1);
+  a->tag = mpc_ast_realloc(a->tag, strlen(a->tag) + 1, strlen(t) + 1);
   strcpy(a->tag, t);
   return a;
 }
@@ -3365,6 +3735,7 @@ static mpc_parser_t *mpca_grammar_find_parser(char *x, mpca_grammar_st_t *st) {
       if (st->parsers[st->parsers_num-1] == NULL) {
         return mpc_failf("No Parser in position %i! Only supplied %i Parsers!", i, st->parsers_num);
       }
+      st->parsers[st->parsers_num-1]->id = st->parsers_num;
     }
     
     return st->parsers[st->parsers_num-1];
@@ -3389,6 +3760,7 @@ static mpc_parser_t *mpca_grammar_find_parser(char *x, mpca_grammar_st_t *st) {
       st->parsers[st->parsers_num-1] = p;
       
       if (p == NULL || p->name == NULL) { return mpc_failf("Unknown Parser '%s'!", x); }
+      p->id = st->parsers_num;
       if (p->name && strcmp(p->name, x) == 0) { return p; }
       
     }
@@ -3397,17 +3769,36 @@ static mpc_parser_t *mpca_grammar_find_parser(char *x, mpca_grammar_st_t *st) {
   
 }
 
+/*
+** Nodes keep the id of the innermost rule
+** that produced them, so the outer rules
+** which wrap the same node leave it alone.
+*/
+
+static mpc_val_t *mpcaf_grammar_ast_id(mpc_val_t *x, void *p) {
+  mpc_ast_t *a = x;
+  if (a && a->id == 0) { a->id = ((mpc_parser_t*)p)->id; }
+  return a;
+}
+
+mpc_parser_t *mpca_ref(mpc_parser_t *p, int id) {
+  
+  p->id = id;
+  
+  if (p->name) {
+    return mpca_state(mpca_root(mpc_apply_to(mpca_add_tag(p, p->name), mpcaf_grammar_ast_id, p)));
+  } else {
+    return mpca_state(mpca_root(mpc_apply_to(p, mpcaf_grammar_ast_id, p)));
+  }
+}
+
 static mpc_val_t *mpcaf_grammar_id(mpc_val_t *x, void *s) {
   
   mpca_grammar_st_t *st = s;
   mpc_parser_t *p = mpca_grammar_find_parser(x, st);
   free(x);
-
-  if (p->name) {
-    return mpca_state(mpca_root(mpca_add_tag(p, p->name)));
-  } else {
-    return mpca_state(mpca_root(p));
-  }
+  
+  return mpca_ref(p, p->id);
 }
 
 mpc_parser_t *mpca_grammar_st(const char *grammar, mpca_grammar_st_t *st) {
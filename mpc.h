@@ -70,6 +70,20 @@ int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result
 int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r);
 
+/*
+** Streaming
+*/
+
+struct mpc_stream_t;
+typedef struct mpc_stream_t mpc_stream_t;
+
+mpc_stream_t *mpc_stream_file(const char *filename, FILE *file);
+mpc_stream_t *mpc_stream_pipe(const char *filename, FILE *pipe);
+int mpc_stream_next(mpc_stream_t *s, mpc_parser_t *p, mpc_result_t *r);
+int mpc_stream_done(mpc_stream_t *s);
+long mpc_stream_pos(mpc_stream_t *s);
+void mpc_stream_delete(mpc_stream_t *s);
+
 /*
 ** Function Types
 */
@@ -268,14 +282,41 @@ mpc_parser_t *mpc_re(const char *re);
 ** AST
 */
 
+/*
+** `id` is the position (starting from 1) of the
+** innermost grammar rule that built the node in
+** the parser list given to `mpca_lang`, or the
+** id given to `mpca_ref` when the rules are put
+** together by hand. Tokens not belonging to any
+** named rule have id 0.
+*/
+
 typedef struct mpc_ast_t {
   char *tag;
+  int id;
   char *contents;
   mpc_state_t state;
   int children_num;
   struct mpc_ast_t** children;
 } mpc_ast_t;
 
+/*
+** While an arena is set with `mpc_ast_arena` all
+** new AST nodes are allocated inside it, and
+** `mpc_ast_delete` does nothing. The trees are
+** freed all at once by `mpc_arena_clear` or
+** `mpc_arena_delete`. Pass NULL to go back to
+** individually allocated nodes.
+*/
+
+struct mpc_arena_t;
+typedef struct mpc_arena_t mpc_arena_t;
+
+mpc_arena_t *mpc_arena_new(void);
+void mpc_arena_clear(mpc_arena_t *a);
+void mpc_arena_delete(mpc_arena_t *a);
+void mpc_ast_arena(mpc_arena_t *a);
+
 mpc_ast_t *mpc_ast_new(const char *tag, const char *contents);
 mpc_ast_t *mpc_ast_build(int n, const char *tag, ...);
 mpc_ast_t *mpc_ast_add_root(mpc_ast_t *a);
@@ -325,6 +366,7 @@ mpc_val_t *mpcf_state_ast(int n, mpc_val_t **xs);
 mpc_parser_t *mpca_tag(mpc_parser_t *a, const char *t);
 mpc_parser_t *mpca_add_tag(mpc_parser_t *a, const char *t);
 mpc_parser_t *mpca_root(mpc_parser_t *a);
+mpc_parser_t *mpca_ref(mpc_parser_t *p, int id);
 mpc_parser_t *mpca_state(mpc_parser_t *a);
 mpc_parser_t *mpca_total(mpc_parser_t *a);
 
@@ -360,6 +402,19 @@ void mpc_print(mpc_parser_t *p);
 void mpc_optimise(mpc_parser_t *p);
 void mpc_stats(mpc_parser_t *p);
 
+/*
+** Counters for the small object pool used
+** while parsing, summed over every input.
+*/
+
+typedef struct {
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long grows;
+} mpc_mem_stats_t;
+
+void mpc_mem_stats(mpc_mem_stats_t *s);
+
 int mpc_test_pass(mpc_parser_t *p, const char *s, const void *d,
   int(*tester)(const void*, const void*), 
   mpc_dtor_t destructor, 
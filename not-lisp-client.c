@@ -0,0 +1,81 @@
+/* Sends a program to `nlisp --serve SOCKET` and prints what comes back */
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/* Write all of n bytes, however many calls it takes */
+int write_all(int fd, const char *p, size_t n)
+{
+  while (n > 0)
+  {
+    ssize_t w = write(fd, p, n);
+    if (w <= 0)
+    {
+      return 0;
+    }
+    p += w;
+    n -= w;
+  }
+  return 1;
+}
+
+int main(int argc, char **argv)
+{
+  if (argc < 2)
+  {
+    fprintf(stderr, "Usage: %s SOCKET [EXPR ...]\n", argv[0]);
+    fprintf(stderr, "Without EXPR the program is read from standard input.\n");
+    return 2;
+  }
+
+  struct sockaddr_un addr;
+  if (strlen(argv[1]) >= sizeof(addr.sun_path))
+  {
+    fprintf(stderr, "Socket path too long: %s\n", argv[1]);
+    return 2;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, argv[1]);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+  {
+    fprintf(stderr, "Could not connect to %s\n", argv[1]);
+    return 1;
+  }
+
+  /* Arguments are sent as one program, one per line */
+  int ok = 1;
+  if (argc > 2)
+  {
+    for (int i = 2; i < argc && ok; i++)
+    {
+      ok = write_all(fd, argv[i], strlen(argv[i])) && write_all(fd, "\n", 1);
+    }
+  }
+  else
+  {
+    char chunk[4096];
+    size_t n;
+    while (ok && (n = fread(chunk, 1, sizeof(chunk), stdin)) > 0)
+    {
+      ok = write_all(fd, chunk, n);
+    }
+  }
+  shutdown(fd, SHUT_WR);
+
+  char chunk[4096];
+  ssize_t n;
+  while ((n = read(fd, chunk, sizeof(chunk))) > 0)
+  {
+    fwrite(chunk, 1, n, stdout);
+  }
+  close(fd);
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,233 @@
+/* Turns a trace written by `nlisp --trace FILE` into Chrome trace event JSON */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TRACE_MAGIC "NLTRACE"
+#define TRACE_VERSION 1
+
+enum
+{
+  TRACE_CALL,
+  TRACE_RETURN
+};
+
+typedef struct
+{
+  unsigned char *pos;
+  unsigned char *end;
+  int bad;
+} reader;
+
+int read_byte(reader *r)
+{
+  if (r->pos >= r->end)
+  {
+    r->bad = 1;
+    return 0;
+  }
+  return *r->pos++;
+}
+
+/* Zigzag varints, as lbuf_varint writes them */
+long read_varint(reader *r)
+{
+  unsigned long u = 0;
+  for (int shift = 0; shift < (int)sizeof(long) * 8; shift += 7)
+  {
+    int c = read_byte(r);
+    u |= (unsigned long)(c & 0x7f) << shift;
+    if (!(c & 0x80))
+    {
+      return (long)(u >> 1) ^ -(long)(u & 1);
+    }
+  }
+  r->bad = 1;
+  return 0;
+}
+
+/* A count, which can't be more than the bytes left since each item takes at least one */
+long read_count(reader *r)
+{
+  long n = read_varint(r);
+  if (n < 0 || n > r->end - r->pos)
+  {
+    r->bad = 1;
+    return 0;
+  }
+  return n;
+}
+
+char *read_string(reader *r)
+{
+  long n = read_count(r);
+  char *s = malloc(n + 1);
+  memcpy(s, r->pos, n);
+  s[n] = '\0';
+  r->pos += n;
+  return s;
+}
+
+void write_json_string(FILE *out, const char *s)
+{
+  fputc('"', out);
+  for (; *s; s++)
+  {
+    unsigned char c = (unsigned char)*s;
+    if (c == '"' || c == '\\')
+    {
+      fprintf(out, "\\%c", c);
+    }
+    else if (c < 0x20)
+    {
+      fprintf(out, "\\u%04x", c);
+    }
+    else
+    {
+      fputc(c, out);
+    }
+  }
+  fputc('"', out);
+}
+
+int main(int argc, char **argv)
+{
+  if (argc < 2)
+  {
+    fprintf(stderr, "Usage: %s TRACE [OUT.json]\n", argv[0]);
+    fprintf(stderr, "Without OUT.json the JSON goes to standard output.\n");
+    return 2;
+  }
+
+  FILE *in = fopen(argv[1], "rb");
+  if (in == NULL)
+  {
+    fprintf(stderr, "Could not open %s\n", argv[1]);
+    return 1;
+  }
+  fseek(in, 0, SEEK_END);
+  long len = ftell(in);
+  fseek(in, 0, SEEK_SET);
+  unsigned char *data = malloc(len > 0 ? len : 1);
+  len = (long)fread(data, 1, len > 0 ? len : 0, in);
+  fclose(in);
+
+  reader r = {data, data + len, 0};
+  if (len < (long)sizeof(TRACE_MAGIC) + 1 || memcmp(data, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0)
+  {
+    fprintf(stderr, "%s is not a trace\n", argv[1]);
+    return 1;
+  }
+  r.pos += sizeof(TRACE_MAGIC);
+  if (read_byte(&r) != TRACE_VERSION)
+  {
+    fprintf(stderr, "%s is from another version\n", argv[1]);
+    return 1;
+  }
+
+  long nfuncs = read_count(&r);
+  char **funcs = malloc(sizeof(char *) * (nfuncs + 1));
+  char **places = malloc(sizeof(char *) * (nfuncs + 1));
+  for (long i = 0; i < nfuncs; i++)
+  {
+    funcs[i] = read_string(&r);
+    places[i] = read_string(&r);
+  }
+  long nbuiltins = read_count(&r);
+  char **builtins = malloc(sizeof(char *) * (nbuiltins + 1));
+  for (long i = 0; i < nbuiltins; i++)
+  {
+    builtins[i] = read_string(&r);
+  }
+  long dropped = read_varint(&r);
+  long count = read_count(&r);
+  if (r.bad)
+  {
+    fprintf(stderr, "%s is cut short\n", argv[1]);
+    return 1;
+  }
+
+  FILE *out = argc > 2 ? fopen(argv[2], "w") : stdout;
+  if (out == NULL)
+  {
+    fprintf(stderr, "Could not write %s\n", argv[2]);
+    return 1;
+  }
+
+  /*
+  ** The ring may begin inside calls whose start was dropped: their
+  ** returns are skipped, and calls still open at the end are closed there
+  */
+  fprintf(out, "{\"traceEvents\":[");
+  long long ns = 0;
+  long depth = 0;
+  int first = 1;
+  for (long i = 0; i < count && !r.bad; i++)
+  {
+    long id = read_varint(&r);
+    int kind = read_byte(&r);
+    ns += read_varint(&r);
+    if (kind == TRACE_RETURN && depth == 0)
+    {
+      continue;
+    }
+
+    fprintf(out, "%s\n{\"ph\":\"%c\",\"ts\":%lld.%03lld,\"pid\":1,\"tid\":1",
+            first ? "" : ",", kind == TRACE_CALL ? 'B' : 'E', ns / 1000, ns % 1000);
+    first = 0;
+    if (kind == TRACE_CALL)
+    {
+      depth++;
+      fprintf(out, ",\"name\":");
+      if (id > 0 && id <= nfuncs)
+      {
+        write_json_string(out, funcs[id - 1]);
+        fprintf(out, ",\"cat\":\"lambda\",\"args\":{\"defined\":");
+        write_json_string(out, places[id - 1]);
+        fprintf(out, "}");
+      }
+      else
+      {
+        write_json_string(out, id < 0 && -id <= nbuiltins ? builtins[-id - 1] : "builtin");
+        fprintf(out, ",\"cat\":\"builtin\"");
+      }
+    }
+    else
+    {
+      depth--;
+    }
+    fprintf(out, "}");
+  }
+  for (; depth > 0; depth--)
+  {
+    fprintf(out, "%s\n{\"ph\":\"E\",\"ts\":%lld.%03lld,\"pid\":1,\"tid\":1}",
+            first ? "" : ",", ns / 1000, ns % 1000);
+    first = 0;
+  }
+  fprintf(out, "\n],\"displayTimeUnit\":\"ns\",\"otherData\":{\"dropped\":%li}}\n", dropped);
+  if (out != stdout)
+  {
+    fclose(out);
+  }
+
+  for (long i = 0; i < nfuncs; i++)
+  {
+    free(funcs[i]);
+    free(places[i]);
+  }
+  for (long i = 0; i < nbuiltins; i++)
+  {
+    free(builtins[i]);
+  }
+  free(funcs);
+  free(places);
+  free(builtins);
+  free(data);
+
+  if (r.bad)
+  {
+    fprintf(stderr, "%s is cut short\n", argv[1]);
+    return 1;
+  }
+  return 0;
+}
@@ -1,4 +1,11 @@
+/* mmap, realpath and friends are hidden by -std=c99 otherwise */
+#define _XOPEN_SOURCE 700
+
 #include "mpc.h"
+#include <limits.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
 
 #ifdef _WIN32
 
@@ -19,6 +26,48 @@ void add_history(char *unused) {}
 #else
 #include <editline/readline.h>
 #include <editline/history.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+/*
+** Static probes for bpftrace, perf and SystemTap, as notlisp:call-entry
+** and so on. They need <sys/sdt.h> and a build with -DNOTLISP_PROBES;
+** each is then a nop until a tracer attaches. Otherwise they are nothing.
+** Each has a semaphore the tracer raises while attached, so arguments
+** that cost something to work out are only worked out then.
+*/
+#ifdef NOTLISP_PROBES
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+#define NOTLISP_SEMAPHORE(name) \
+  unsigned short notlisp_##name##_semaphore __attribute__((unused, section(".probes")))
+NOTLISP_SEMAPHORE(alloc);
+NOTLISP_SEMAPHORE(free);
+NOTLISP_SEMAPHORE(realloc);
+NOTLISP_SEMAPHORE(load__start);
+NOTLISP_SEMAPHORE(load__done);
+NOTLISP_SEMAPHORE(builtin__entry);
+NOTLISP_SEMAPHORE(builtin__return);
+NOTLISP_SEMAPHORE(call__entry);
+NOTLISP_SEMAPHORE(call__return);
+#define NOTLISP_ENABLED(name) __builtin_expect(notlisp_##name##_semaphore, 0)
+#define NOTLISP_PROBE1(name, a) DTRACE_PROBE1(notlisp, name, a)
+#define NOTLISP_PROBE2(name, a, b) DTRACE_PROBE2(notlisp, name, a, b)
+#define NOTLISP_PROBE3(name, a, b, c) DTRACE_PROBE3(notlisp, name, a, b, c)
+#else
+#define NOTLISP_ENABLED(name) 0
+#define NOTLISP_PROBE1(name, a)
+#define NOTLISP_PROBE2(name, a, b)
+#define NOTLISP_PROBE3(name, a, b, c)
 #endif
 
 #define LASSERT(args, cond, fmt, ...)         \
@@ -49,6 +98,83 @@ void add_history(char *unused) {}
           "Got %i, Expected %i.",                                \
           func, args->count, num)
 
+/*
+** Every allocation the interpreter makes goes through these so it can be
+** counted. Each block starts with its size, which lets lfree keep the
+** count of bytes still in use exact. Memory from mpc, readline and
+** realpath is still released with plain free.
+*/
+struct
+{
+  unsigned long count;
+  unsigned long bytes;
+  unsigned long frees;
+  size_t live;
+  size_t peak;
+} Allocs;
+
+typedef union
+{
+  size_t size;
+  long double align;
+  void *p;
+} lhead;
+
+void *lmalloc(size_t n)
+{
+  Allocs.count++;
+  Allocs.bytes += n;
+  Allocs.live += n;
+  if (Allocs.live > Allocs.peak)
+  {
+    Allocs.peak = Allocs.live;
+  }
+  lhead *h = malloc(sizeof(lhead) + n);
+  h->size = n;
+  NOTLISP_PROBE2(alloc, h + 1, n);
+  return h + 1;
+}
+
+void lfree(void *p)
+{
+  if (p == NULL)
+  {
+    return;
+  }
+  lhead *h = (lhead *)p - 1;
+  NOTLISP_PROBE2(free, p, h->size);
+  Allocs.frees++;
+  Allocs.live -= h->size;
+  free(h);
+}
+
+void *lrealloc(void *p, size_t n)
+{
+  if (p == NULL)
+  {
+    return lmalloc(n);
+  }
+  lhead *h = (lhead *)p - 1;
+  Allocs.count++;
+  Allocs.bytes += n;
+  Allocs.live += n - h->size;
+  if (Allocs.live > Allocs.peak)
+  {
+    Allocs.peak = Allocs.live;
+  }
+  h = realloc(h, sizeof(lhead) + n);
+  h->size = n;
+  NOTLISP_PROBE3(realloc, p, h + 1, n);
+  return h + 1;
+}
+
+void *lcalloc(size_t n, size_t size)
+{
+  void *p = lmalloc(n * size);
+  memset(p, 0, n * size);
+  return p;
+}
+
 mpc_parser_t *Number;
 mpc_parser_t *Boolean;
 mpc_parser_t *Symbol;
@@ -59,6 +185,26 @@ mpc_parser_t *NotLispy;
 mpc_parser_t *String;
 mpc_parser_t *Comment;
 
+/* Characters a symbol is made of */
+#define SYMBOL_CHARS "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_+-*/\\=<>!&|"
+
+/* Every parse result lives here until it has been read */
+mpc_arena_t *Arena;
+
+/* Rule ids, in the order the parsers are passed to mpca_lang */
+enum
+{
+  RULE_COMMENT = 1,
+  RULE_STRING,
+  RULE_BOOLEAN,
+  RULE_NUMBER,
+  RULE_SYMBOL,
+  RULE_SEXPR,
+  RULE_QEXPR,
+  RULE_EXPR,
+  RULE_NOTLISPY
+};
+
 struct lval;
 struct lenv;
 typedef struct lval lval;
@@ -102,6 +248,18 @@ char *ltype_name(int t)
   }
 }
 
+/* What lvals and lenvs were made, copied and freed, for heap-stats */
+struct
+{
+  unsigned long lvals[LVAL_QEXPR + 1];
+  unsigned long lval_frees;
+  unsigned long lval_copies;
+  unsigned long lval_adds;
+  unsigned long lenvs;
+  unsigned long lenv_frees;
+  unsigned long lenv_copies;
+} Heap;
+
 typedef lval *(*lbuiltin)(lenv *, lval *);
 typedef enum
 {
@@ -121,51 +279,62 @@ struct lval
   lenv *env;
   lval *formals;
   lval *body;
+  /* Set on functions a module exports, which then run in the module's environment */
+  lenv *module;
+  /* Lambdas: the entry def or fun gave them in Funcs, 0 if none */
+  int fn;
+  /* Where it was read, or a lambda made, in Spans; 0 if unknown */
+  int span;
 
   int count;
   lval **cell;
 };
 
+lval *lval_new(int type)
+{
+  lval *v = lmalloc(sizeof(lval));
+  v->type = type;
+  v->span = 0;
+  Heap.lvals[type]++;
+  return v;
+}
+
 lval *lval_str(char *x)
 {
-  lval *v = malloc(sizeof(lval));
-  v->type = LVAL_STR;
-  v->str = malloc(strlen(x) + 1);
+  lval *v = lval_new(LVAL_STR);
+  v->str = lmalloc(strlen(x) + 1);
   strcpy(v->str, x);
   return v;
 }
 
 lval *lval_num(long x)
 {
-  lval *v = malloc(sizeof(lval));
-  v->type = LVAL_NUM;
+  lval *v = lval_new(LVAL_NUM);
   v->num = x;
   return v;
 }
 
 lval *lval_bool(long x)
 {
-  lval *v = malloc(sizeof(lval));
-  v->type = LVAL_BOOl;
+  lval *v = lval_new(LVAL_BOOl);
   v->num = !!x;
   return v;
 }
 
 lval *lval_err(char *fmt, ...)
 {
-  lval *v = malloc(sizeof(lval));
-  v->type = LVAL_ERR;
+  lval *v = lval_new(LVAL_ERR);
 
   /* Create and init list */
   va_list va;
   va_start(va, fmt);
 
   /* Allocate 512 bytes for error */
-  v->err = malloc(512);
+  v->err = lmalloc(512);
 
   vsnprintf(v->err, 511, fmt, va);
 
-  v->err = realloc(v->err, strlen(v->err) + 1);
+  v->err = lrealloc(v->err, strlen(v->err) + 1);
 
   /* Clean up list */
   va_end(va);
@@ -175,25 +344,24 @@ lval *lval_err(char *fmt, ...)
 
 lval *lval_sym(char *s)
 {
-  lval *v = malloc(sizeof(lval));
-  v->type = LVAL_SYM;
-  v->sym = malloc(strlen(s) + 1);
+  lval *v = lval_new(LVAL_SYM);
+  v->sym = lmalloc(strlen(s) + 1);
   strcpy(v->sym, s);
   return v;
 }
 
 lval *lval_fun(lbuiltin func)
 {
-  lval *v = malloc(sizeof(lval));
-  v->type = LVAL_FUN;
+  lval *v = lval_new(LVAL_FUN);
+  v->sym = NULL;
   v->builtin = func;
+  v->fn = 0;
   return v;
 }
 
 lval *lval_sexpr(void)
 {
-  lval *v = malloc(sizeof(lval));
-  v->type = LVAL_SEXPR;
+  lval *v = lval_new(LVAL_SEXPR);
   v->count = 0;
   v->cell = NULL;
   return v;
@@ -201,8 +369,7 @@ lval *lval_sexpr(void)
 
 lval *lval_qexpr(void)
 {
-  lval *v = malloc(sizeof(lval));
-  v->type = LVAL_QEXPR;
+  lval *v = lval_new(LVAL_QEXPR);
   v->cell = NULL;
   v->count = 0;
   return v;
@@ -217,14 +384,14 @@ void lval_del(lval *v)
     break;
 
   case LVAL_ERR:
-    free(v->err);
+    lfree(v->err);
     break;
   case LVAL_SYM:
-    free(v->sym);
+    lfree(v->sym);
     break;
 
   case LVAL_STR:
-    free(v->str);
+    lfree(v->str);
     break;
 
   /* If Sexpr then delete all elements inside */
@@ -235,9 +402,10 @@ void lval_del(lval *v)
       lval_del(v->cell[i]);
     }
     /* Also free the memory allocated to contain the pointers */
-    free(v->cell);
+    lfree(v->cell);
     break;
   case LVAL_FUN:
+    lfree(v->sym);
     if (!v->builtin)
     {
       lenv_del(v->env);
@@ -248,18 +416,22 @@ void lval_del(lval *v)
   }
 
   /* Free the memory allocated for the "lval" struct itself */
-  free(v);
+  Heap.lval_frees++;
+  lfree(v);
 }
 
 lenv *lenv_copy(lenv *e);
 lval *lval_copy(lval *v)
 {
-  lval *x = malloc(sizeof(lval));
-  x->type = v->type;
+  lval *x = lval_new(v->type);
+  x->span = v->span;
+  Heap.lval_copies++;
 
   switch (v->type)
   {
   case LVAL_FUN:
+    x->sym = NULL;
+    x->fn = v->fn;
     if (v->builtin)
     {
       x->builtin = v->builtin;
@@ -270,29 +442,31 @@ lval *lval_copy(lval *v)
       x->env = lenv_copy(v->env);
       x->formals = lval_copy(v->formals);
       x->body = lval_copy(v->body);
+      x->module = v->module;
     }
     break;
   case LVAL_NUM:
+  case LVAL_BOOl:
     x->num = v->num;
     break;
   case LVAL_ERR:
-    x->err = malloc(strlen(v->err) + 1);
+    x->err = lmalloc(strlen(v->err) + 1);
     strcpy(x->err, v->err);
     break;
   case LVAL_SYM:
-    x->sym = malloc(strlen(v->sym) + 1);
+    x->sym = lmalloc(strlen(v->sym) + 1);
     strcpy(x->sym, v->sym);
     break;
 
   case LVAL_STR:
-    x->str = malloc(strlen(v->str) + 1);
+    x->str = lmalloc(strlen(v->str) + 1);
     strcpy(x->str, v->str);
     break;
 
   case LVAL_SEXPR:
   case LVAL_QEXPR:
     x->count = v->count;
-    x->cell = malloc(sizeof(lval *) * x->count);
+    x->cell = lmalloc(sizeof(lval *) * x->count);
     for (int i = 0; i < x->count; i++)
     {
       x->cell[i] = lval_copy(v->cell[i]);
@@ -304,8 +478,9 @@ lval *lval_copy(lval *v)
 
 lval *lval_add(lval *v, lval *x)
 {
+  Heap.lval_adds++;
   v->count++;
-  v->cell = realloc(v->cell, sizeof(lval *) * v->count);
+  v->cell = lrealloc(v->cell, sizeof(lval *) * v->count);
   v->cell[v->count - 1] = x;
   return v;
 }
@@ -316,8 +491,9 @@ lval *lval_join(lval *x, lval *y)
   {
     x = lval_add(x, y->cell[i]);
   }
-  free(y->cell);
-  free(y);
+  lfree(y->cell);
+  lfree(y);
+  Heap.lval_frees++;
   return x;
 }
 
@@ -327,7 +503,7 @@ lval *lval_pop(lval *v, int i)
   memmove(&v->cell[i],
           &v->cell[i + 1], sizeof(lval *) * (v->count - i - 1));
   v->count--;
-  v->cell = realloc(v->cell, sizeof(lval *) * v->count);
+  v->cell = lrealloc(v->cell, sizeof(lval *) * v->count);
   return x;
 }
 
@@ -338,77 +514,200 @@ lval *lval_take(lval *v, int i)
   return x;
 }
 
+/* A growable byte buffer, used for printing and the binary encoding */
+typedef struct
+{
+  unsigned char *data;
+  size_t len;
+  size_t cap;
+} lbuf;
+
+void lbuf_byte(lbuf *b, unsigned char c)
+{
+  if (b->len == b->cap)
+  {
+    b->cap = b->cap ? b->cap * 2 : 4096;
+    b->data = lrealloc(b->data, b->cap);
+  }
+  b->data[b->len++] = c;
+}
+
+void lbuf_bytes(lbuf *b, const void *p, size_t n)
+{
+  while (b->len + n > b->cap)
+  {
+    b->cap = b->cap ? b->cap * 2 : 4096;
+    b->data = lrealloc(b->data, b->cap);
+  }
+  memcpy(b->data + b->len, p, n);
+  b->len += n;
+}
+
 /* Print lval */
-void lval_print(lval *v);
-void lval_expr_print(lval *v, char open, char close)
+/*
+** Values are rendered into a buffer and written out in one go, rather
+** than a stdio call per token. The buffer is kept between prints.
+*/
+lbuf PrintBuf;
+
+/* Decimal digits written backwards into a small scratch space */
+void lbuf_long(lbuf *b, long x)
 {
-  putchar(open);
-  for (int i = 0; i < v->count; i++)
+  char digits[24];
+  int n = 0;
+  unsigned long u = x < 0 ? 0UL - (unsigned long)x : (unsigned long)x;
+  do
+  {
+    digits[sizeof(digits) - 1 - n++] = (char)('0' + u % 10);
+    u /= 10;
+  } while (u);
+  if (x < 0)
   {
+    digits[sizeof(digits) - 1 - n++] = '-';
+  }
+  lbuf_bytes(b, digits + sizeof(digits) - n, n);
+}
 
-    /* Print Value contained within */
-    lval_print(v->cell[i]);
+void lbuf_str(lbuf *b, const char *s)
+{
+  lbuf_bytes(b, s, strlen(s));
+}
 
-    /* Don't print trailing space if last element */
-    if (i != (v->count - 1))
+/* s with the escapes mpcf_escape would use, without copying it first */
+void lbuf_escaped(lbuf *b, const char *s)
+{
+  const char *run = s;
+  for (; *s; s++)
+  {
+    char c;
+    switch (*s)
     {
-      putchar(' ');
+    case '\a': c = 'a'; break;
+    case '\b': c = 'b'; break;
+    case '\f': c = 'f'; break;
+    case '\n': c = 'n'; break;
+    case '\r': c = 'r'; break;
+    case '\t': c = 't'; break;
+    case '\v': c = 'v'; break;
+    case '\\': c = '\\'; break;
+    case '\'': c = '\''; break;
+    case '"': c = '"'; break;
+    default: continue;
     }
+    lbuf_bytes(b, run, s - run);
+    lbuf_byte(b, '\\');
+    lbuf_byte(b, (unsigned char)c);
+    run = s + 1;
   }
-  putchar(close);
+  lbuf_bytes(b, run, s - run);
 }
 
-void lval_print_str(lval *v)
+void lval_render(lbuf *b, lval *v);
+void lbuf_span(lbuf *b, int span);
+void lval_expr_render(lbuf *b, lval *v, char open, char close)
 {
-  char *escaped = malloc(strlen(v->str) + 1);
-  strcpy(escaped, v->str);
-  escaped = mpcf_escape(escaped);
-  printf("\"%s\"", escaped);
-  free(escaped);
+  lbuf_byte(b, open);
+  for (int i = 0; i < v->count; i++)
+  {
+
+    /* Render Value contained within */
+    lval_render(b, v->cell[i]);
+
+    /* Don't render trailing space if last element */
+    if (i != (v->count - 1))
+    {
+      lbuf_byte(b, ' ');
+    }
+  }
+  lbuf_byte(b, close);
 }
 
-void lval_print(lval *v)
+void lval_render(lbuf *b, lval *v)
 {
   switch (v->type)
   {
   case LVAL_NUM:
-    printf("%li", v->num);
+    lbuf_long(b, v->num);
     break;
   case LVAL_ERR:
-    printf("Error: %s", v->err);
+    lbuf_str(b, "Error: ");
+    if (v->span)
+    {
+      lbuf_span(b, v->span);
+      lbuf_str(b, ": ");
+    }
+    lbuf_str(b, v->err);
     break;
   case LVAL_SYM:
-    printf("%s", v->sym);
+    lbuf_str(b, v->sym);
     break;
   case LVAL_SEXPR:
-    lval_expr_print(v, '(', ')');
+    lval_expr_render(b, v, '(', ')');
     break;
   case LVAL_QEXPR:
-    lval_expr_print(v, '{', '}');
+    lval_expr_render(b, v, '{', '}');
     break;
   case LVAL_FUN:
-    printf("<%s>", v->sym);
+    lbuf_byte(b, '<');
+    lbuf_str(b, v->sym ? v->sym : (v->builtin ? "builtin" : "lambda"));
+    lbuf_byte(b, '>');
     break;
   case LVAL_BOOl:
-    if (v->num)
-    {
-      printf("%s", "true");
-    }
-    else
-    {
-      printf("%s", "false");
-    }
+    lbuf_str(b, v->num ? "true" : "false");
     break;
   case LVAL_STR:
-    lval_print_str(v);
+    lbuf_byte(b, '"');
+    lbuf_escaped(b, v->str);
+    lbuf_byte(b, '"');
     break;
   }
 }
 
+/* Write out and empty the print buffer */
+void lval_flush(void)
+{
+  fwrite(PrintBuf.data, 1, PrintBuf.len, stdout);
+  PrintBuf.len = 0;
+}
+
+void lval_print(lval *v)
+{
+  lval_render(&PrintBuf, v);
+  lval_flush();
+}
+
 void lval_println(lval *v)
 {
-  lval_print(v);
-  putchar('\n');
+  lval_render(&PrintBuf, v);
+  lbuf_byte(&PrintBuf, '\n');
+  lval_flush();
+}
+
+/* Definitions seen by a lazy load but not evaluated yet, with their source */
+typedef struct
+{
+  int count;
+  char **syms;
+  char **srcs;
+  char **files;
+  int *lines;
+  int *cols;
+} llazy;
+
+void llazy_del(llazy *l)
+{
+  for (int i = 0; i < l->count; i++)
+  {
+    lfree(l->syms[i]);
+    lfree(l->srcs[i]);
+    lfree(l->files[i]);
+  }
+  lfree(l->syms);
+  lfree(l->srcs);
+  lfree(l->files);
+  lfree(l->lines);
+  lfree(l->cols);
+  lfree(l);
 }
 
 /* Environment */
@@ -418,15 +717,21 @@ struct lenv
   int count;
   char **syms;
   lval **vals;
+  llazy *lazy;
+  /* A module's environment is where def stops, even though it has a parent */
+  bool module;
 };
 
 lenv *lenv_new(void)
 {
-  lenv *e = malloc(sizeof(lenv));
+  lenv *e = lmalloc(sizeof(lenv));
+  Heap.lenvs++;
   e->parent = NULL;
   e->count = 0;
   e->syms = NULL;
   e->vals = NULL;
+  e->lazy = NULL;
+  e->module = false;
   return e;
 }
 
@@ -434,69 +739,507 @@ void lenv_del(lenv *e)
 {
   for (int i = 0; i < e->count; i++)
   {
-    free(e->syms[i]);
+    lfree(e->syms[i]);
     lval_del(e->vals[i]);
   }
-  free(e->syms);
-  free(e->vals);
-  free(e);
+  lfree(e->syms);
+  lfree(e->vals);
+  if (e->lazy)
+  {
+    llazy_del(e->lazy);
+  }
+  Heap.lenv_frees++;
+  lfree(e);
 }
 
 lenv *lenv_copy(lenv *e)
 {
-  lenv *n = malloc(sizeof(lenv));
+  lenv *n = lmalloc(sizeof(lenv));
+  Heap.lenvs++;
+  Heap.lenv_copies++;
   n->parent = e->parent;
+  n->lazy = NULL;
+  n->module = false;
   n->count = e->count;
-  n->syms = malloc(sizeof(char *) * n->count);
-  n->vals = malloc(sizeof(lval *) * n->count);
+  n->syms = lmalloc(sizeof(char *) * n->count);
+  n->vals = lmalloc(sizeof(lval *) * n->count);
   for (int i = 0; i < e->count; i++)
   {
-    n->syms[i] = malloc(strlen(e->syms[i]) + 1);
+    n->syms[i] = lmalloc(strlen(e->syms[i]) + 1);
     strcpy(n->syms[i], e->syms[i]);
     n->vals[i] = lval_copy(e->vals[i]);
   }
   return n;
 }
 
+// Source spans
+/*
+** Where values read from source came from, kept out of the lval in a
+** table of distinct positions. An lval holds only an index into it, so
+** copies cost nothing and reading the same text again takes no more room.
+*/
+typedef struct
+{
+  int file;
+  int line;
+  int col;
+} lspan;
+
+struct
+{
+  lspan *spans;
+  long count;
+  long *slots; /* index + 1, or 0 when empty */
+  long cap;
+} Spans;
+
+/*
+** The file being read and the row and column its text starts at, and the
+** span of the top-level form being evaluated, which the lambdas it makes keep
+*/
+struct
+{
+  int file;
+  int row;
+  int col;
+  int span;
+} Source;
+
+unsigned long span_hash(int file, int line, int col)
+{
+  return ((unsigned long)file * 2654435761UL) ^ ((unsigned long)line * 40503UL) ^ (unsigned long)col;
+}
+
+/* Ids count from 1, 0 is no span */
+int span_id(int file, int line, int col)
+{
+  if ((Spans.count + 1) * 2 > Spans.cap)
+  {
+    long cap = Spans.cap ? Spans.cap * 2 : 1024;
+    long *slots = lcalloc(cap, sizeof(long));
+    for (long i = 0; i < Spans.count; i++)
+    {
+      lspan *p = &Spans.spans[i];
+      unsigned long j = span_hash(p->file, p->line, p->col) & (cap - 1);
+      while (slots[j])
+      {
+        j = (j + 1) & (cap - 1);
+      }
+      slots[j] = i + 1;
+    }
+    lfree(Spans.slots);
+    Spans.slots = slots;
+    Spans.cap = cap;
+    Spans.spans = lrealloc(Spans.spans, sizeof(lspan) * cap / 2);
+  }
+
+  unsigned long j = span_hash(file, line, col) & (Spans.cap - 1);
+  while (Spans.slots[j])
+  {
+    lspan *p = &Spans.spans[Spans.slots[j] - 1];
+    if (p->file == file && p->line == line && p->col == col)
+    {
+      return (int)Spans.slots[j];
+    }
+    j = (j + 1) & (Spans.cap - 1);
+  }
+  lspan *p = &Spans.spans[Spans.count];
+  p->file = file;
+  p->line = line;
+  p->col = col;
+  Spans.slots[j] = ++Spans.count;
+  return (int)Spans.count;
+}
+
+char *source_name(int file);
+
+/* The position of span, all 0 for no span */
+lspan span_at(int span)
+{
+  lspan none = {0, 0, 0};
+  return span ? Spans.spans[span - 1] : none;
+}
+
+/* "file:line:col" for span, which must not be 0 */
+void lbuf_span(lbuf *b, int span)
+{
+  lspan *p = &Spans.spans[span - 1];
+  char pos[32];
+  lbuf_str(b, source_name(p->file));
+  snprintf(pos, sizeof(pos), ":%i:%i", p->line, p->col);
+  lbuf_str(b, pos);
+}
+
+void spans_del(void)
+{
+  lfree(Spans.spans);
+  lfree(Spans.slots);
+}
+
+// Metrics
+/*
+** Counters behind (metrics nil) and --metrics, shown in the Prometheus
+** text format. Only the thread that evaluates touches them, so they are
+** plain increments and stay on all the time. SIGUSR1 just raises a flag;
+** the file is written at the next evaluation step, not in the handler.
+*/
+#define LOOKUP_DEPTHS 1024
+
+long long now_ns(void);
+
+/* Upper bounds of the eval latency buckets, in seconds */
+const double EvalBounds[] = {0.00001, 0.0001, 0.001, 0.01, 0.1, 1, 10};
+#define EVAL_BUCKETS (sizeof(EvalBounds) / sizeof(EvalBounds[0]))
+
+struct
+{
+  unsigned long evals;
+  char **builtins; /* Names by id - 1 */
+  unsigned long *builtin_calls; /* By id, 0 for a builtin with none */
+  int nbuiltins;
+  unsigned long lookups[LOOKUP_DEPTHS + 1]; /* By parents walked, the last for more */
+  unsigned long lookup_depths;
+  unsigned long global_hits;   /* Lookups that found their global slot in GlobalCache */
+  unsigned long global_misses; /* And those that had to search */
+  unsigned long parsed_bytes;
+  long long parse_ns;
+  unsigned long eval_counts[EVAL_BUCKETS + 1];
+  long long eval_ns;
+} Metrics;
+
+char *MetricsFile;
+volatile sig_atomic_t MetricsDump;
+
+/* The id counted for calls of the builtin registered as name */
+int metrics_builtin(char *name)
+{
+  for (int i = 0; i < Metrics.nbuiltins; i++)
+  {
+    if (strcmp(Metrics.builtins[i], name) == 0)
+    {
+      return i + 1;
+    }
+  }
+  int n = ++Metrics.nbuiltins;
+  Metrics.builtins = lrealloc(Metrics.builtins, sizeof(char *) * n);
+  Metrics.builtins[n - 1] = lmalloc(strlen(name) + 1);
+  strcpy(Metrics.builtins[n - 1], name);
+  Metrics.builtin_calls = lrealloc(Metrics.builtin_calls, sizeof(unsigned long) * (n + 1));
+  Metrics.builtin_calls[n] = 0;
+  if (n == 1)
+  {
+    Metrics.builtin_calls[0] = 0;
+  }
+  return n;
+}
+
+/* Time to evaluate one top-level form, program or REPL line */
+void metrics_eval(long long ns)
+{
+  size_t i = 0;
+  while (i < EVAL_BUCKETS && ns > EvalBounds[i] * 1e9)
+  {
+    i++;
+  }
+  Metrics.eval_counts[i]++;
+  Metrics.eval_ns += ns;
+}
+
+void metrics_head(lbuf *b, char *name, char *type, char *help)
+{
+  lbuf_str(b, "# HELP ");
+  lbuf_str(b, name);
+  lbuf_byte(b, ' ');
+  lbuf_str(b, help);
+  lbuf_str(b, "\n# TYPE ");
+  lbuf_str(b, name);
+  lbuf_byte(b, ' ');
+  lbuf_str(b, type);
+  lbuf_byte(b, '\n');
+}
+
+void metrics_count(lbuf *b, char *name, unsigned long x)
+{
+  char line[256];
+  snprintf(line, sizeof(line), "%s %lu\n", name, x);
+  lbuf_str(b, line);
+}
+
+void metrics_seconds(lbuf *b, char *name, long long ns)
+{
+  char line[256];
+  snprintf(line, sizeof(line), "%s %lld.%09lld\n", name, ns / 1000000000, ns % 1000000000);
+  lbuf_str(b, line);
+}
+
+/* Label values escape backslash, quote and newline */
+void metrics_label(lbuf *b, char *s)
+{
+  for (; *s; s++)
+  {
+    if (*s == '\\' || *s == '"')
+    {
+      lbuf_byte(b, '\\');
+      lbuf_byte(b, (unsigned char)*s);
+    }
+    else if (*s == '\n')
+    {
+      lbuf_str(b, "\\n");
+    }
+    else
+    {
+      lbuf_byte(b, (unsigned char)*s);
+    }
+  }
+}
+
+void metrics_bucket(lbuf *b, char *name, double le, unsigned long count)
+{
+  char line[256];
+  if (le < 0)
+  {
+    snprintf(line, sizeof(line), "%s_bucket{le=\"+Inf\"} %lu\n", name, count);
+  }
+  else
+  {
+    snprintf(line, sizeof(line), "%s_bucket{le=\"%g\"} %lu\n", name, le, count);
+  }
+  lbuf_str(b, line);
+}
+
+void metrics_report(lbuf *b)
+{
+  metrics_head(b, "notlisp_evaluations_total", "counter", "S-Expressions evaluated.");
+  metrics_count(b, "notlisp_evaluations_total", Metrics.evals);
+
+  metrics_head(b, "notlisp_builtin_calls_total", "counter", "Calls of each builtin.");
+  for (int i = 0; i < Metrics.nbuiltins; i++)
+  {
+    char count[32];
+    lbuf_str(b, "notlisp_builtin_calls_total{builtin=\"");
+    metrics_label(b, Metrics.builtins[i]);
+    snprintf(count, sizeof(count), "\"} %lu\n", Metrics.builtin_calls[i + 1]);
+    lbuf_str(b, count);
+  }
+
+  metrics_head(b, "notlisp_lookup_depth", "histogram",
+               "Parent environments walked by each symbol lookup.");
+  unsigned long total = 0;
+  for (int d = 0; d <= LOOKUP_DEPTHS; d++)
+  {
+    total += Metrics.lookups[d];
+    if (d < LOOKUP_DEPTHS && (d & (d - 1)) == 0)
+    {
+      metrics_bucket(b, "notlisp_lookup_depth", d, total);
+    }
+  }
+  metrics_bucket(b, "notlisp_lookup_depth", -1, total);
+  metrics_count(b, "notlisp_lookup_depth_sum", Metrics.lookup_depths);
+  metrics_count(b, "notlisp_lookup_depth_count", total);
+
+  metrics_head(b, "notlisp_global_cache_hits_total", "counter",
+               "Global lookups answered by the slot their symbol found before.");
+  metrics_count(b, "notlisp_global_cache_hits_total", Metrics.global_hits);
+  metrics_head(b, "notlisp_global_cache_misses_total", "counter",
+               "Global lookups that searched the global environment.");
+  metrics_count(b, "notlisp_global_cache_misses_total", Metrics.global_misses);
+
+  metrics_head(b, "notlisp_parsed_bytes_total", "counter", "Source bytes parsed.");
+  metrics_count(b, "notlisp_parsed_bytes_total", Metrics.parsed_bytes);
+  metrics_head(b, "notlisp_parse_seconds_total", "counter", "Time spent parsing.");
+  metrics_seconds(b, "notlisp_parse_seconds_total", Metrics.parse_ns);
+
+  metrics_head(b, "notlisp_allocations_total", "counter", "Interpreter allocations.");
+  metrics_count(b, "notlisp_allocations_total", Allocs.count);
+  metrics_head(b, "notlisp_allocated_bytes_total", "counter", "Bytes allocated by the interpreter.");
+  metrics_count(b, "notlisp_allocated_bytes_total", Allocs.bytes);
+  metrics_head(b, "notlisp_heap_bytes", "gauge", "Bytes the interpreter has in use.");
+  metrics_count(b, "notlisp_heap_bytes", Allocs.live);
+  metrics_head(b, "notlisp_heap_peak_bytes", "gauge", "Most bytes the interpreter has had in use.");
+  metrics_count(b, "notlisp_heap_peak_bytes", Allocs.peak);
+
+  metrics_head(b, "notlisp_eval_seconds", "histogram",
+               "Time to evaluate each top-level form.");
+  total = 0;
+  for (size_t i = 0; i < EVAL_BUCKETS; i++)
+  {
+    total += Metrics.eval_counts[i];
+    metrics_bucket(b, "notlisp_eval_seconds", EvalBounds[i], total);
+  }
+  total += Metrics.eval_counts[EVAL_BUCKETS];
+  metrics_bucket(b, "notlisp_eval_seconds", -1, total);
+  metrics_seconds(b, "notlisp_eval_seconds_sum", Metrics.eval_ns);
+  metrics_count(b, "notlisp_eval_seconds_count", total);
+}
+
+/* Write the metrics to MetricsFile through a temporary file, so a scraper never sees half */
+void metrics_write(void)
+{
+  MetricsDump = 0;
+  lbuf b = {NULL, 0, 0};
+  metrics_report(&b);
+  char *tmp = lmalloc(strlen(MetricsFile) + 8);
+  sprintf(tmp, "%s.tmp", MetricsFile);
+  FILE *f = fopen(tmp, "wb");
+  if (f)
+  {
+    fwrite(b.data, 1, b.len, f);
+    fclose(f);
+    rename(tmp, MetricsFile);
+  }
+  lfree(tmp);
+  lfree(b.data);
+}
+
+#ifndef _WIN32
+void metrics_signal(int sig)
+{
+  MetricsDump = 1;
+}
+
+/* With SA_RESTART, so reads and waits carry on; serve waits in poll, which the signal still wakes */
+void metrics_start(void)
+{
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = metrics_signal;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGUSR1, &sa, NULL);
+}
+#else
+void metrics_start(void) {}
+#endif
+
+void metrics_del(void)
+{
+  for (int i = 0; i < Metrics.nbuiltins; i++)
+  {
+    lfree(Metrics.builtins[i]);
+  }
+  lfree(Metrics.builtins);
+  lfree(Metrics.builtin_calls);
+}
+
 lval *lval_lambda(lval *formals, lval *body)
 {
-  lval *v = malloc(sizeof(lval));
-  v->type = LVAL_FUN;
+  lval *v = lval_new(LVAL_FUN);
 
   // Indicate that it's not builtin function
   v->builtin = NULL;
+  v->sym = NULL;
 
   // Build env for the lambda.
   v->env = lenv_new();
 
   v->formals = formals;
   v->body = body;
+  v->module = NULL;
+  v->fn = 0;
+  v->span = Source.span;
 
   return v;
 }
 
-lval *lenv_get(lenv *e, lval *k)
+/*
+** Callers' environments are parents of the callee's, so any of them may
+** bind a name and every lookup has to walk the whole chain. What can be
+** saved is the search of the global environment at its end, the largest
+** by far: each symbol read from source keeps, by its span, the slot its
+** name was last found in there. A slot is only used if it still holds
+** that name, so redefinitions and other root environments are safe.
+*/
+struct
+{
+  int *slots; /* By span, slot + 1 or 0 */
+  long cap;
+} GlobalCache;
+
+void global_cache_put(int span, int slot)
+{
+  if (span >= GlobalCache.cap)
+  {
+    long cap = GlobalCache.cap ? GlobalCache.cap : 1024;
+    while (cap <= span)
+    {
+      cap *= 2;
+    }
+    GlobalCache.slots = lrealloc(GlobalCache.slots, sizeof(int) * cap);
+    memset(GlobalCache.slots + GlobalCache.cap, 0, sizeof(int) * (cap - GlobalCache.cap));
+    GlobalCache.cap = cap;
+  }
+  GlobalCache.slots[span] = slot + 1;
+}
+
+void global_cache_del(void)
 {
+  lfree(GlobalCache.slots);
+}
+
+int lenv_resolve_lazy(lenv *e, char *sym);
+/* Look k up in e, which is depth parents away from where the lookup started */
+lval *lenv_get_at(lenv *e, lval *k, int depth)
+{
+  int global = e->parent == NULL && k->span;
+  if (global)
+  {
+    int slot = k->span < GlobalCache.cap ? GlobalCache.slots[k->span] - 1 : -1;
+    if (slot >= 0 && slot < e->count && strcmp(e->syms[slot], k->sym) == 0)
+    {
+      Metrics.global_hits++;
+      Metrics.lookups[depth < LOOKUP_DEPTHS ? depth : LOOKUP_DEPTHS]++;
+      Metrics.lookup_depths += depth;
+      return lval_copy(e->vals[slot]);
+    }
+    Metrics.global_misses++;
+  }
+
   for (int i = 0; i < e->count; i++)
   {
     // Check if the stored string matches the symbol string
     // If it does, return a copy of the value
     if (strcmp(e->syms[i], k->sym) == 0)
     {
+      if (global)
+      {
+        global_cache_put(k->span, i);
+      }
+      Metrics.lookups[depth < LOOKUP_DEPTHS ? depth : LOOKUP_DEPTHS]++;
+      Metrics.lookup_depths += depth;
       return lval_copy(e->vals[i]);
     }
   }
 
+  /* A lazily loaded definition is evaluated the first time it is needed */
+  if (e->lazy && lenv_resolve_lazy(e, k->sym))
+  {
+    return lenv_get_at(e, k, depth);
+  }
+
   if (e->parent)
   {
-    return lenv_get(e->parent, k);
+    return lenv_get_at(e->parent, k, depth + 1);
   }
 
+  Metrics.lookups[depth < LOOKUP_DEPTHS ? depth : LOOKUP_DEPTHS]++;
+  Metrics.lookup_depths += depth;
   return lval_err("unbound symbol '%s'!", k->sym);
 }
 
+lval *lenv_get(lenv *e, lval *k)
+{
+  return lenv_get_at(e, k, 0);
+}
+
+void lenv_drop_lazy(lenv *e, char *sym);
 void lenv_put(lenv *e, lval *k, lval *v)
 {
+  /* Binding a name directly overrides what was deferred under it */
+  if (e->lazy)
+  {
+    lenv_drop_lazy(e, k->sym);
+  }
+
   for (int i = 0; i < e->count; i++)
   {
     if (strcmp(e->syms[i], k->sym) == 0)
@@ -509,17 +1252,17 @@ void lenv_put(lenv *e, lval *k, lval *v)
 
   /* New entry, make space */
   e->count++;
-  e->vals = realloc(e->vals, sizeof(lval *) * e->count);
-  e->syms = realloc(e->syms, sizeof(char *) * e->count);
+  e->vals = lrealloc(e->vals, sizeof(lval *) * e->count);
+  e->syms = lrealloc(e->syms, sizeof(char *) * e->count);
 
   e->vals[e->count - 1] = lval_copy(v);
-  e->syms[e->count - 1] = malloc(strlen(k->sym) + 1);
+  e->syms[e->count - 1] = lmalloc(strlen(k->sym) + 1);
   strcpy(e->syms[e->count - 1], k->sym);
 }
 
 void lenv_def(lenv *e, lval *k, lval *v)
 {
-  while (e->parent)
+  while (e->parent && !e->module)
   {
     e = e->parent;
   }
@@ -789,606 +1532,3840 @@ lval *builtin_lte(lenv *e, lval *a)
   return builtin_ord(e, a, "<=");
 }
 
-lval *lval_read(mpc_ast_t *t);
-lval *builtin_load(lenv *e, lval *a)
+// Binary encoding
+/*
+** Values are written in a compact binary form for images, the load
+** cache and serialize. Numbers and lengths are zigzag varints, strings
+** are length prefixed and lists carry their count, so the reader never
+** has to look ahead. Symbol names are interned: a table of every name
+** comes first and each symbol after it is just an index. Builtins are
+** stored by the name lenv_add_builtins gives them, since their
+** addresses change from run to run.
+*/
+
+/* Bump whenever lval_write changes */
+#define BIN_VERSION 5
+
+void lbuf_varint(lbuf *b, long x)
 {
-  LASSERT_NUM("load", a, 1);
-  LASSERT_TYPE("load", a, 0, LVAL_STR);
-
-  mpc_result_t r;
-  if (mpc_parse_contents(a->cell[0]->str, NotLispy, &r))
+  unsigned long u = ((unsigned long)x << 1) ^ (unsigned long)(x >> (sizeof(long) * 8 - 1));
+  while (u >= 0x80)
   {
+    lbuf_byte(b, (unsigned char)(u | 0x80));
+    u >>= 7;
+  }
+  lbuf_byte(b, (unsigned char)u);
+}
 
-    lval *expr = lval_read(r.output);
-    mpc_ast_delete(r.output);
+void lbuf_string(lbuf *b, const char *s)
+{
+  size_t n = strlen(s);
+  lbuf_varint(b, (long)n);
+  lbuf_bytes(b, s, n);
+}
+
+/* Symbol names seen by a writer, found again through an open addressed table */
+typedef struct
+{
+  char **names;
+  long count;
+  long *slots; /* index + 1, or 0 when empty */
+  long cap;
+} lsymtab;
+
+unsigned long lsym_hash(const char *s)
+{
+  unsigned long h = 5381;
+  while (*s)
+  {
+    h = h * 33 + (unsigned char)*s++;
+  }
+  return h;
+}
 
-    while (expr->count)
+long lsymtab_intern(lsymtab *t, char *name)
+{
+  if ((t->count + 1) * 2 > t->cap)
+  {
+    long cap = t->cap ? t->cap * 2 : 64;
+    long *slots = lcalloc(cap, sizeof(long));
+    for (long i = 0; i < t->count; i++)
     {
-      lval *x = lval_eval(e, lval_pop(expr, 0));
-      if (x->type == LVAL_ERR)
+      unsigned long j = lsym_hash(t->names[i]) & (cap - 1);
+      while (slots[j])
       {
-        lval_println(x);
+        j = (j + 1) & (cap - 1);
       }
-      lval_del(x);
+      slots[j] = i + 1;
     }
-    lval_del(expr);
-    lval_del(a);
-    return lval_sexpr();
+    lfree(t->slots);
+    t->slots = slots;
+    t->cap = cap;
+    t->names = lrealloc(t->names, sizeof(char *) * cap / 2);
   }
-  else
+
+  unsigned long j = lsym_hash(name) & (t->cap - 1);
+  while (t->slots[j])
   {
-    char *err_msg = mpc_err_string(r.error);
-    mpc_err_delete(r.error);
-    lval *err = lval_err("Could not load Library %s", err_msg);
-    free(err_msg);
-    lval_del(a);
+    if (strcmp(t->names[t->slots[j] - 1], name) == 0)
+    {
+      return t->slots[j] - 1;
+    }
+    j = (j + 1) & (t->cap - 1);
+  }
+  t->names[t->count] = lmalloc(strlen(name) + 1);
+  strcpy(t->names[t->count], name);
+  t->slots[j] = ++t->count;
+  return t->count - 1;
+}
 
-    return err;
+void lsymtab_del(lsymtab *t)
+{
+  for (long i = 0; i < t->count; i++)
+  {
+    lfree(t->names[i]);
   }
+  lfree(t->names);
+  lfree(t->slots);
 }
 
-lval *builtin_print(lenv *e, lval *a)
+// Call statistics
+/*
+** def and fun give a lambda an entry in Funcs, one per name and place
+** of definition, that copies of it share. With --call-stats lval_call
+** keeps a frame per call being evaluated and adds its calls, time and
+** allocations to that entry; lambdas without one are counted under
+** where they were made. Time and allocations are both total, from
+** entry to return, and self, less what the calls it made used.
+*/
+lsymtab SourceFiles;
+
+/* Ids count from 1, 0 is an unknown file */
+int source_file(char *filename)
 {
+  return (int)lsymtab_intern(&SourceFiles, filename) + 1;
+}
 
-  /* Print each argument followed by a space */
-  for (int i = 0; i < a->count; i++)
+char *source_name(int file)
+{
+  return file ? SourceFiles.names[file - 1] : "?";
+}
+
+typedef struct
+{
+  char *name;
+  int span;
+  unsigned long calls;
+  long long total;
+  long long self;
+  unsigned long allocs;
+  unsigned long self_allocs;
+  /* Calls to it under way, so recursion adds to total only once */
+  int active;
+} lfunc;
+
+struct
+{
+  lsymtab keys;
+  lfunc *funcs;
+  /* The ids of lambdas without one by where they were made, so a call doesn't build the key */
+  int *anon;
+  long nanon;
+} Funcs;
+
+int func_id(char *name, int span)
+{
+  char *key = lmalloc(strlen(name) + 32);
+  sprintf(key, "%s %i", name, span);
+  long count = Funcs.keys.count;
+  long i = lsymtab_intern(&Funcs.keys, key);
+  lfree(key);
+  if (Funcs.keys.count > count)
   {
-    lval_print(a->cell[i]);
-    putchar(' ');
+    Funcs.funcs = lrealloc(Funcs.funcs, sizeof(lfunc) * Funcs.keys.count);
+    lfunc *f = &Funcs.funcs[i];
+    memset(f, 0, sizeof(lfunc));
+    f->name = lmalloc(strlen(name) + 1);
+    strcpy(f->name, name);
+    f->span = span;
   }
+  return (int)i + 1;
+}
 
-  /* Print a newline and delete arguments */
-  putchar('\n');
-  lval_del(a);
+/* The id counted for calls of a lambda that def and fun never named */
+int func_anon(int span)
+{
+  if (span >= Funcs.nanon)
+  {
+    long n = Funcs.nanon ? Funcs.nanon : 1024;
+    while (n <= span)
+    {
+      n *= 2;
+    }
+    Funcs.anon = lrealloc(Funcs.anon, sizeof(int) * n);
+    memset(Funcs.anon + Funcs.nanon, 0, sizeof(int) * (n - Funcs.nanon));
+    Funcs.nanon = n;
+  }
+  if (Funcs.anon[span] == 0)
+  {
+    Funcs.anon[span] = func_id("lambda", span);
+  }
+  return Funcs.anon[span];
+}
 
-  return lval_sexpr();
+/* What a lambda is called in reports: its definition's name, else the symbol it was called by */
+char *func_label(lval *f)
+{
+  return f->fn ? Funcs.funcs[f->fn - 1].name : (f->sym ? f->sym : "lambda");
 }
 
-lval *builtin_error(lenv *e, lval *a)
+/* Give a lambda being bound to name an entry, unless it has one already */
+void func_name(lval *v, char *name)
 {
-  LASSERT_NUM("error", a, 1);
-  LASSERT_TYPE("error", a, 0, LVAL_STR);
+  if (v->type == LVAL_FUN && !v->builtin && !v->fn)
+  {
+    v->fn = func_id(name, v->span);
+  }
+}
 
-  /* Construct Error from first argument */
-  lval *err = lval_err(a->cell[0]->str);
+long long now_ns(void);
 
-  /* Delete arguments and return */
-  lval_del(a);
-  return err;
+/* Set by --call-stats */
+int CallStats = 0;
+
+typedef struct
+{
+  int fn;
+  long long start;
+  long long child;
+  unsigned long allocs;
+  unsigned long child_allocs;
+} lframe;
+
+struct
+{
+  lframe *frames;
+  int depth;
+  int cap;
+} Calls;
+
+void calls_enter(lval *f)
+{
+  int fn = f->fn ? f->fn : func_anon(f->span);
+  if (Calls.depth == Calls.cap)
+  {
+    Calls.cap = Calls.cap ? Calls.cap * 2 : 64;
+    Calls.frames = lrealloc(Calls.frames, sizeof(lframe) * Calls.cap);
+  }
+  lframe *c = &Calls.frames[Calls.depth++];
+  c->fn = fn;
+  c->child = 0;
+  c->child_allocs = 0;
+  Funcs.funcs[fn - 1].active++;
+  c->allocs = Allocs.count;
+  c->start = now_ns();
 }
 
-int lval_eq(lval *x, lval *y)
+void calls_leave(void)
 {
-  if (x->type != y->type)
+  long long end = now_ns();
+  lframe *c = &Calls.frames[--Calls.depth];
+  long long took = end - c->start;
+  unsigned long allocs = Allocs.count - c->allocs;
+
+  lfunc *f = &Funcs.funcs[c->fn - 1];
+  f->calls++;
+  f->self += took - c->child;
+  f->self_allocs += allocs - c->child_allocs;
+  if (--f->active == 0)
   {
-    return 0;
+    f->total += took;
+    f->allocs += allocs;
+  }
+  if (Calls.depth)
+  {
+    Calls.frames[Calls.depth - 1].child += took;
+    Calls.frames[Calls.depth - 1].child_allocs += allocs;
   }
+}
 
-  switch (x->type)
+int cmp_func_self(const void *a, const void *b)
+{
+  const lfunc *x = *(const lfunc **)a, *y = *(const lfunc **)b;
+  return (y->self > x->self) - (y->self < x->self);
+}
+
+/* A table of the functions called so far, most self time first */
+void calls_report(lbuf *b)
+{
+  lfunc **sorted = lmalloc(sizeof(lfunc *) * (Funcs.keys.count + 1));
+  long n = 0;
+  for (long i = 0; i < Funcs.keys.count; i++)
   {
-  case LVAL_NUM:
-  case LVAL_BOOl:
-    return (x->num == y->num);
-  case LVAL_STR:
-    return (strcmp(x->str, y->str) == 0);
-  case LVAL_ERR:
-    return (strcmp(x->err, y->err) == 0);
-  case LVAL_SYM:
-    return (strcmp(x->sym, y->sym) == 0);
-  case LVAL_FUN:
-    if (x->builtin || y->builtin)
-    {
-      return x->builtin == y->builtin;
-    }
-    else
+    if (Funcs.funcs[i].calls)
     {
-      return lval_eq(x->formals, y->formals) && lval_eq(x->body, y->body);
+      sorted[n++] = &Funcs.funcs[i];
     }
-  case LVAL_SEXPR:
-  case LVAL_QEXPR:
-    if (x->count != y->count)
+  }
+  qsort(sorted, n, sizeof(lfunc *), cmp_func_self);
+
+  char line[512];
+  snprintf(line, sizeof(line), "%-24s %10s %12s %12s %12s %12s  %s\n",
+           "function", "calls", "total ms", "self ms", "allocs", "self allocs", "defined");
+  lbuf_str(b, line);
+  for (long i = 0; i < n; i++)
+  {
+    lfunc *f = sorted[i];
+    snprintf(line, sizeof(line), "%-24s %10lu %12.3f %12.3f %12lu %12lu  ",
+             f->name, f->calls, f->total / 1e6, f->self / 1e6,
+             f->allocs, f->self_allocs);
+    lbuf_str(b, line);
+    if (f->span)
     {
-      return 0;
+      lbuf_span(b, f->span);
     }
-    for (int i = 0; i < x->count; i++)
+    else
     {
-      if (!lval_eq(x->cell[i], y->cell[i]))
-      {
-        return 0;
-      }
+      lbuf_byte(b, '?');
     }
-    return 1;
-    break;
+    lbuf_byte(b, '\n');
   }
-  return 0;
+  lfree(sorted);
 }
 
-lval *builtin_cmp(lenv *e, lval *a, char *op)
+void calls_del(void)
 {
-  int r;
-  if (strcmp(op, "==") == 0)
-  {
-    r = lval_eq(a->cell[0], a->cell[1]);
-  }
-  if (strcmp(op, "!=") == 0)
+  for (long i = 0; i < Funcs.keys.count; i++)
   {
-    r = !lval_eq(a->cell[0], a->cell[1]);
+    lfree(Funcs.funcs[i].name);
   }
-  lval_del(a);
-  return lval_num(r);
+  lfree(Funcs.funcs);
+  lfree(Funcs.anon);
+  lsymtab_del(&Funcs.keys);
+  lsymtab_del(&SourceFiles);
+  lfree(Calls.frames);
+  spans_del();
 }
 
-lval *builtin_eq(lenv *e, lval *a)
+/* Values are written to body while their names collect in syms */
+typedef struct
 {
-  return builtin_cmp(e, a, "==");
+  lbuf body;
+  lsymtab syms;
+  lenv *builtins;
+  /* Modules of the lambdas written so far, in the order they were first written */
+  lenv **modules;
+  int nmodules;
+} lwriter;
+
+void lwriter_init(lwriter *w, lenv *builtins)
+{
+  memset(w, 0, sizeof(lwriter));
+  w->builtins = builtins;
 }
 
-lval *builtin_ne(lenv *e, lval *a)
+void lwriter_del(lwriter *w)
 {
-  return builtin_cmp(e, a, "!=");
+  lfree(w->body.data);
+  lsymtab_del(&w->syms);
+  lfree(w->modules);
 }
 
-lval *builtin_if(lenv *e, lval *a)
+void lwriter_sym(lwriter *w, char *name)
 {
-  LASSERT_NUM("if", a, 3);
-  LASSERT_TYPE("if", a, 1, LVAL_QEXPR);
-  LASSERT_TYPE("if", a, 2, LVAL_QEXPR);
+  lbuf_varint(&w->body, lsymtab_intern(&w->syms, name));
+}
 
-  /* Mark Both Expressions as evaluable */
-  lval *x;
-  a->cell[1]->type = LVAL_SEXPR;
-  a->cell[2]->type = LVAL_SEXPR;
+/* A span as its file name, "" for none, then line and column */
+void lwriter_span(lwriter *w, int span)
+{
+  lspan *p = span ? &Spans.spans[span - 1] : NULL;
+  lwriter_sym(w, p ? source_name(p->file) : "");
+  lbuf_varint(&w->body, p ? p->line : 0);
+  lbuf_varint(&w->body, p ? p->col : 0);
+}
 
-  if (a->cell[0]->num)
-  {
-    x = lval_eval(e, lval_pop(a, 1));
-  }
-  else
+/* Append the symbol table then everything written to out */
+void lwriter_finish(lwriter *w, lbuf *out)
+{
+  lbuf_varint(out, w->syms.count);
+  for (long i = 0; i < w->syms.count; i++)
   {
-    x = lval_eval(e, lval_pop(a, 2));
+    lbuf_string(out, w->syms.names[i]);
   }
-
-  lval_del(a);
-  return x;
+  lbuf_bytes(out, w->body.data, w->body.len);
 }
 
-lval *builtin_and(lenv *e, lval *a)
+typedef struct
 {
-  LASSERT_NUM("&&", a, 2);
-
-  int x;
-  if (a->cell[0]->type == LVAL_QEXPR)
-  {
-    a->cell[0]->type = LVAL_SEXPR;
-  }
+  const unsigned char *pos;
+  const unsigned char *end;
+  lenv *builtins;
+  char **syms;
+  long nsyms;
+  int bad;
+  /* Modules read so far, by the writer's order; those new to this run have their path in paths */
+  lenv **modules;
+  char **paths;
+  int nmodules;
+  /* Set when what is read replaces the global environment, so no module of this run may be used */
+  int fresh;
+} lreader;
+
+void lreader_init(lreader *r, const unsigned char *data, size_t len, lenv *builtins)
+{
+  memset(r, 0, sizeof(lreader));
+  r->pos = data;
+  r->end = data + len;
+  r->builtins = builtins;
+}
 
-  if (a->cell[1]->type == LVAL_QEXPR)
+int lreader_byte(lreader *r)
+{
+  if (r->pos >= r->end)
   {
-    a->cell[1]->type = LVAL_SEXPR;
+    r->bad = 1;
+    return 0;
   }
-
-  lval *b = lval_eval(e, lval_pop(a, 0));
-  lval *c = lval_eval(e, lval_pop(a, 0));
-  x = (b->num && c->num);
-  return lval_bool(x);
+  return *r->pos++;
 }
 
-lval *builtin_or(lenv *e, lval *a)
+long lreader_varint(lreader *r)
 {
-  LASSERT_NUM("||", a, 2);
-
-  int x;
-  if (a->cell[0]->type == LVAL_QEXPR)
+  unsigned long u = 0;
+  for (int shift = 0; shift < (int)sizeof(long) * 8; shift += 7)
   {
-    a->cell[0]->type = LVAL_SEXPR;
+    int c = lreader_byte(r);
+    u |= (unsigned long)(c & 0x7f) << shift;
+    if (!(c & 0x80))
+    {
+      return (long)(u >> 1) ^ -(long)(u & 1);
+    }
   }
+  r->bad = 1;
+  return 0;
+}
 
-  if (a->cell[1]->type == LVAL_QEXPR)
+/* The next count, which can't be more than the bytes left since each item takes at least one */
+long lreader_count(lreader *r)
+{
+  long n = lreader_varint(r);
+  if (n < 0 || n > r->end - r->pos)
   {
-    a->cell[1]->type = LVAL_SEXPR;
+    r->bad = 1;
+    return 0;
   }
+  return n;
+}
 
-  lval *b = lval_eval(e, lval_pop(a, 0));
-  lval *c = lval_eval(e, lval_pop(a, 0));
-  x = (b->num || c->num);
-  return lval_bool(x);
+/* A fresh copy of the next string */
+char *lreader_string(lreader *r)
+{
+  long n = lreader_count(r);
+  char *s = lmalloc(n + 1);
+  memcpy(s, r->pos, n);
+  s[n] = '\0';
+  r->pos += n;
+  return s;
 }
 
-lval *builtin_not(lenv *e, lval *a)
+/* Read the symbol table lwriter_finish put before the values */
+void lreader_begin(lreader *r)
 {
-  LASSERT_NUM("!", a, 1);
-  int x;
-  if (a->cell[0]->type == LVAL_QEXPR)
+  r->nsyms = lreader_count(r);
+  r->syms = lmalloc(sizeof(char *) * (r->nsyms ? r->nsyms : 1));
+  for (long i = 0; i < r->nsyms; i++)
   {
-    a->cell[0]->type = LVAL_SEXPR;
+    r->syms[i] = lreader_string(r);
   }
-
-  lval *b = lval_eval(e, lval_pop(a, 0));
-  x = !b->num;
-  return lval_bool(x);
 }
 
-lval *builtin_var(lenv *e, lval *a, char *func)
+/* Modules a bad read made and lreader_modules never took are freed here */
+void lreader_end(lreader *r)
 {
-  LASSERT_TYPE(func, a, 0, LVAL_QEXPR);
-
-  lval *syms = a->cell[0];
-  for (int i = 0; i < syms->count; i++)
+  for (long i = 0; i < r->nsyms; i++)
   {
-    LASSERT(a, (syms->cell[i]->type == LVAL_SYM),
-            "Function '%s' cannot define non-symbol. "
-            "Got %s, Expected %s.",
-            func,
-            ltype_name(syms->cell[i]->type), ltype_name(LVAL_SYM));
+    lfree(r->syms[i]);
   }
-
-  LASSERT(a, (syms->count == a->count - 1),
-          "Function '%s' passed too many arguments for symbols. "
-          "Got %i, Expected %i.",
-          func, syms->count, a->count - 1);
-
-  for (int i = 0; i < syms->count; i++)
+  lfree(r->syms);
+  for (int i = 0; i < r->nmodules; i++)
   {
-    /* If 'def' define in globally. If 'put' define in locally */
-    if (strcmp(func, "def") == 0)
-    {
-      lenv_def(e, syms->cell[i], a->cell[i + 1]);
-    }
-
-    if (strcmp(func, "=") == 0)
+    if (r->paths[i])
     {
-      lenv_put(e, syms->cell[i], a->cell[i + 1]);
+      lfree(r->paths[i]);
+      lenv_del(r->modules[i]);
     }
   }
-
-  lval_del(a);
-  return lval_sexpr();
+  lfree(r->modules);
+  lfree(r->paths);
 }
 
-lval *builtin_def(lenv *e, lval *a)
+/* A fresh copy of the next interned name */
+char *lreader_sym(lreader *r)
 {
-  return builtin_var(e, a, "def");
+  long i = lreader_varint(r);
+  char *name = "";
+  if (i >= 0 && i < r->nsyms)
+  {
+    name = r->syms[i];
+  }
+  else
+  {
+    r->bad = 1;
+  }
+  char *s = lmalloc(strlen(name) + 1);
+  strcpy(s, name);
+  return s;
 }
 
-lval *builtin_fun(lenv *e, lval *a)
+int source_file(char *filename);
+/* A span written by lwriter_span, as an id in this process */
+int lreader_span(lreader *r)
 {
-  lval *sym = lval_pop(a->cell[0], 0);
-  lenv_put(e, sym, lval_lambda(a->cell[0], a->cell[1]));
-  lval_del(a);
-  lval_del(sym);
-  return lval_sexpr();
+  char *file = lreader_sym(r);
+  int line = (int)lreader_varint(r);
+  int col = (int)lreader_varint(r);
+  int span = *file ? span_id(source_file(file), line, col) : 0;
+  lfree(file);
+  return span;
 }
 
-lval *builtin_put(lenv *e, lval *a)
-{
-  return builtin_var(e, a, "=");
-}
+void lenv_write(lwriter *w, lenv *e);
+char *module_name(lenv *m);
+lenv *module_find(char *path);
+void module_add(char *path, lenv *m);
 
-void lenv_add_builtin(lenv *e, char *name, lbuiltin func)
+/*
+** The module a lambda runs in: 0 for none, else its index + 1, followed
+** the first time by its path and what it defines
+*/
+void lwriter_module(lwriter *w, lenv *m)
 {
-  lval *k = lval_sym(name);
-  lval *v = lval_fun(func);
-  lenv_put(e, k, v);
-  lval_del(k);
-  lval_del(v);
+  if (m == NULL)
+  {
+    lbuf_varint(&w->body, 0);
+    return;
+  }
+  for (int i = 0; i < w->nmodules; i++)
+  {
+    if (w->modules[i] == m)
+    {
+      lbuf_varint(&w->body, i + 1);
+      return;
+    }
+  }
+
+  /* Numbered before its definitions, which may be lambdas of the same module */
+  w->modules = lrealloc(w->modules, sizeof(lenv *) * (w->nmodules + 1));
+  w->modules[w->nmodules++] = m;
+  lbuf_varint(&w->body, w->nmodules);
+  char *path = module_name(m);
+  lbuf_string(&w->body, path ? path : "");
+  while (m->lazy && m->lazy->count)
+  {
+    lenv_resolve_lazy(m, m->lazy->syms[0]);
+  }
+  lenv_write(w, m);
 }
 
-void lenv_add_builtins(lenv *e)
+void lval_write(lwriter *w, lval *v)
 {
-  /* Function on Variables */
-  lenv_add_builtin(e, "def", builtin_def);
-  lenv_add_builtin(e, "fun", builtin_fun);
-
-  /* Functions on Lists */
-  lenv_add_builtin(e, "list", builtin_list);
-  lenv_add_builtin(e, "head", builtin_head);
-  lenv_add_builtin(e, "tail", builtin_tail);
-  lenv_add_builtin(e, "eval", builtin_eval);
-  lenv_add_builtin(e, "join", builtin_join);
-  lenv_add_builtin(e, "cons", builtin_cons);
-  lenv_add_builtin(e, "len", builtin_len);
+  lbuf_byte(&w->body, (unsigned char)v->type);
+  switch (v->type)
+  {
+  case LVAL_NUM:
+  case LVAL_BOOl:
+    lbuf_varint(&w->body, v->num);
+    break;
+  case LVAL_ERR:
+    lbuf_string(&w->body, v->err);
+    break;
+  case LVAL_SYM:
+    lwriter_sym(w, v->sym);
+    lwriter_span(w, v->span);
+    break;
+  case LVAL_STR:
+    lbuf_string(&w->body, v->str);
+    break;
+  case LVAL_SEXPR:
+  case LVAL_QEXPR:
+    lbuf_varint(&w->body, v->count);
+    for (int i = 0; i < v->count; i++)
+    {
+      lval_write(w, v->cell[i]);
+    }
+    lwriter_span(w, v->span);
+    break;
+  case LVAL_FUN:
+    if (v->builtin)
+    {
+      /* Any name bound to the same C function will do */
+      char *name = "";
+      for (int i = 0; w->builtins && i < w->builtins->count; i++)
+      {
+        if (w->builtins->vals[i]->builtin == v->builtin)
+        {
+          name = w->builtins->syms[i];
+          break;
+        }
+      }
+      lbuf_byte(&w->body, 1);
+      lwriter_sym(w, name);
+    }
+    else
+    {
+      lbuf_byte(&w->body, 0);
+      lenv_write(w, v->env);
+      lval_write(w, v->formals);
+      lval_write(w, v->body);
+      lwriter_sym(w, v->fn ? Funcs.funcs[v->fn - 1].name : "");
+      lwriter_span(w, v->span);
+      lwriter_module(w, v->module);
+    }
+    break;
+  }
+}
 
-  /* Mathematical Functions */
-  lenv_add_builtin(e, "+", builtin_add);
-  lenv_add_builtin(e, "-", builtin_sub);
-  lenv_add_builtin(e, "*", builtin_mul);
-  lenv_add_builtin(e, "/", builtin_div);
-  lenv_add_builtin(e, "add", builtin_add);
-  lenv_add_builtin(e, "sub", builtin_sub);
-  lenv_add_builtin(e, "mul", builtin_mul);
-  lenv_add_builtin(e, "div", builtin_div);
-  lenv_add_builtin(e, "\\", builtin_lambda);
+/* Parents are not written: lval_call sets a lambda's parent when it runs */
+void lenv_write(lwriter *w, lenv *e)
+{
+  lbuf_varint(&w->body, e->count);
+  for (int i = 0; i < e->count; i++)
+  {
+    lwriter_sym(w, e->syms[i]);
+    lval_write(w, e->vals[i]);
+  }
+}
 
-  /* Define global  variables. */
-  lenv_add_builtin(e, "=", builtin_put);
+lenv *lenv_read_bin(lreader *r);
 
-  /* Conditionals */
-  lenv_add_builtin(e, ">", builtin_gt);
-  lenv_add_builtin(e, "<", builtin_lt);
-  lenv_add_builtin(e, ">=", builtin_gte);
-  lenv_add_builtin(e, "<=", builtin_lte);
-  lenv_add_builtin(e, "==", builtin_eq);
-  lenv_add_builtin(e, "!=", builtin_ne);
-  lenv_add_builtin(e, "if", builtin_if);
+/*
+** The module written by lwriter_module. One this run has already
+** required is used as it is, unless the read is fresh; any other gets
+** a new environment, which
+** lreader_modules registers once the whole read has succeeded
+*/
+lenv *lreader_module(lreader *r)
+{
+  long k = lreader_varint(r);
+  if (k == 0)
+  {
+    return NULL;
+  }
+  if (k >= 1 && k <= r->nmodules)
+  {
+    return r->modules[k - 1];
+  }
+  if (k != r->nmodules + 1)
+  {
+    r->bad = 1;
+    return NULL;
+  }
 
-  /* Boolean logic */
-  lenv_add_builtin(e, "&&", builtin_and);
-  lenv_add_builtin(e, "||", builtin_or);
-  lenv_add_builtin(e, "!", builtin_not);
+  char *path = lreader_string(r);
+  lenv *m = r->fresh ? NULL : module_find(path);
+  r->modules = lrealloc(r->modules, sizeof(lenv *) * k);
+  r->paths = lrealloc(r->paths, sizeof(char *) * k);
+  r->paths[k - 1] = NULL;
+  if (m == NULL)
+  {
+    m = lenv_new();
+    m->module = true;
+    r->paths[k - 1] = path;
+  }
+  else
+  {
+    lfree(path);
+  }
+  r->modules[k - 1] = m;
+  r->nmodules++;
 
-  /* String Functions */
-  lenv_add_builtin(e, "load", builtin_load);
-  lenv_add_builtin(e, "error", builtin_error);
-  lenv_add_builtin(e, "print", builtin_print);
+  /* Read even for a module already here, to get past them */
+  lenv *defs = lenv_read_bin(r);
+  if (r->paths[k - 1])
+  {
+    m->count = defs->count;
+    m->syms = defs->syms;
+    m->vals = defs->vals;
+    defs->count = 0;
+    defs->syms = NULL;
+    defs->vals = NULL;
+  }
+  lenv_del(defs);
+  return m;
 }
 
-// Evaluation
-lval *lval_call(lenv *e, lval *f, lval *a)
+/* Register the modules a good read made, under root, the global environment they belong to */
+void lreader_modules(lreader *r, lenv *root)
 {
-  if (f->builtin)
+  if (r->bad)
   {
-    return f->builtin(e, a);
+    return;
   }
-  int given = a->count;
-  int total = f->formals->count;
+  for (int i = 0; i < r->nmodules; i++)
+  {
+    if (r->paths[i])
+    {
+      r->modules[i]->parent = root;
+      module_add(r->paths[i], r->modules[i]);
+      lfree(r->paths[i]);
+      r->paths[i] = NULL;
+    }
+  }
+}
 
-  while (a->count)
+/* Whether a lambda read back could have been made by \: formals all symbols, & only before the last */
+int lval_lambda_ok(lval *formals, lval *body)
+{
+  if (formals->type != LVAL_QEXPR || body->type != LVAL_QEXPR)
   {
-    if (f->formals->count == 0)
+    return 0;
+  }
+  for (int i = 0; i < formals->count; i++)
+  {
+    if (formals->cell[i]->type != LVAL_SYM ||
+        (strcmp(formals->cell[i]->sym, "&") == 0 && i != formals->count - 2))
     {
-      lval_del(a);
-      return lval_err("Function passed too many arguments. "
-                      "Got %i, Expected %i.",
-                      given, total);
+      return 0;
     }
+  }
+  return 1;
+}
 
-    lval *sym = lval_pop(f->formals, 0);
+lval *lval_read_bin(lreader *r)
+{
+  int type = lreader_byte(r);
+  lval *v;
+  switch (type)
+  {
+  case LVAL_NUM:
+    return lval_num(lreader_varint(r));
+  case LVAL_BOOl:
+    return lval_bool(lreader_varint(r));
+  case LVAL_ERR:
+    v = lval_new(LVAL_ERR);
+    v->err = lreader_string(r);
+    return v;
+  case LVAL_SYM:
+    v = lval_new(LVAL_SYM);
+    v->sym = lreader_sym(r);
+    v->span = lreader_span(r);
+    return v;
+  case LVAL_STR:
+    v = lval_new(LVAL_STR);
+    v->str = lreader_string(r);
+    return v;
+  case LVAL_SEXPR:
+  case LVAL_QEXPR:
+  {
+    long n = lreader_count(r);
+    v = type == LVAL_SEXPR ? lval_sexpr() : lval_qexpr();
+    v->count = (int)n;
+    v->cell = n ? lmalloc(sizeof(lval *) * n) : NULL;
+    for (long i = 0; i < n; i++)
+    {
+      v->cell[i] = lval_read_bin(r);
+    }
+    v->span = lreader_span(r);
+    return v;
+  }
+  case LVAL_FUN:
+    if (lreader_byte(r))
+    {
+      char *name = lreader_sym(r);
+      lval *func = NULL;
+      for (int i = 0; r->builtins && i < r->builtins->count; i++)
+      {
+        if (strcmp(r->builtins->syms[i], name) == 0)
+        {
+          func = r->builtins->vals[i];
+          break;
+        }
+      }
+      lfree(name);
+      if (func == NULL)
+      {
+        r->bad = 1;
+        return lval_sexpr();
+      }
+      return lval_copy(func);
+    }
+    v = lval_new(LVAL_FUN);
+    v->builtin = NULL;
+    v->sym = NULL;
+    v->env = lenv_read_bin(r);
+    v->formals = lval_read_bin(r);
+    v->body = lval_read_bin(r);
+    char *fname = lreader_sym(r);
+    v->span = lreader_span(r);
+    v->fn = *fname ? func_id(fname, v->span) : 0;
+    lfree(fname);
+    v->module = lreader_module(r);
+    if (!lval_lambda_ok(v->formals, v->body))
+    {
+      r->bad = 1;
+    }
+    return v;
+  }
 
-    if (strcmp(sym->sym, "&") == 0)
+  /* Unknown tag: stop here, the caller throws away what was built */
+  r->bad = 1;
+  r->pos = r->end;
+  return lval_sexpr();
+}
+
+lenv *lenv_read_bin(lreader *r)
+{
+  lenv *e = lenv_new();
+  long n = lreader_count(r);
+  e->count = (int)n;
+  e->syms = lmalloc(sizeof(char *) * (n ? n : 1));
+  e->vals = lmalloc(sizeof(lval *) * (n ? n : 1));
+  for (long i = 0; i < n; i++)
+  {
+    e->syms[i] = lreader_sym(r);
+    e->vals[i] = lval_read_bin(r);
+  }
+  return e;
+}
+
+/* The whole of filename in memory, mapped where possible. NULL if it is empty or unreadable */
+unsigned char *file_map(char *filename, size_t *len)
+{
+  unsigned char *data = NULL;
+#ifdef _WIN32
+  FILE *f = fopen(filename, "rb");
+  if (f == NULL)
+  {
+    return NULL;
+  }
+  fseek(f, 0, SEEK_END);
+  long n = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  if (n > 0)
+  {
+    data = lmalloc(n);
+    if (fread(data, 1, n, f) != (size_t)n)
     {
-      if (f->formals->count != 1)
+      lfree(data);
+      data = NULL;
+    }
+    *len = n;
+  }
+  fclose(f);
+#else
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0)
+  {
+    return NULL;
+  }
+  struct stat st;
+  if (fstat(fd, &st) == 0 && st.st_size > 0)
+  {
+    void *m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (m != MAP_FAILED)
+    {
+      data = m;
+      *len = st.st_size;
+    }
+  }
+  close(fd);
+#endif
+  return data;
+}
+
+void file_unmap(unsigned char *data, size_t len)
+{
+#ifdef _WIN32
+  (void)len;
+  lfree(data);
+#else
+  munmap(data, len);
+#endif
+}
+
+// Load cache
+/*
+** Loading a file leaves the forms it read in a cache file next to it,
+** the name with a 'c' on the end. The cache is keyed by a hash of the
+** source and the interpreter version, so any edit or upgrade just
+** reads the source again and rewrites it.
+*/
+#define NOTLISP_VERSION "0.0.0.1.0"
+#define CACHE_MAGIC "NLSPC"
+
+/* Set to 0 by --no-cache */
+int LoadCache = 1;
+
+/* FNV-1a over the rest of f, which is left rewound */
+unsigned long long file_hash(FILE *f)
+{
+  unsigned long long h = 14695981039346656037ULL;
+  unsigned char chunk[4096];
+  size_t n;
+  while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0)
+  {
+    for (size_t i = 0; i < n; i++)
+    {
+      h = (h ^ chunk[i]) * 1099511628211ULL;
+    }
+  }
+  rewind(f);
+  return h;
+}
+
+char *cache_name(char *filename)
+{
+  char *name = lmalloc(strlen(filename) + 2);
+  strcpy(name, filename);
+  strcat(name, "c");
+  return name;
+}
+
+void cache_header(lbuf *b, unsigned long long hash)
+{
+  lbuf_bytes(b, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+  lbuf_byte(b, BIN_VERSION);
+  lbuf_string(b, NOTLISP_VERSION);
+  for (int i = 0; i < 8; i++)
+  {
+    lbuf_byte(b, (unsigned char)(hash >> (i * 8)));
+  }
+}
+
+/* The forms cached for filename as an S-Expression, or NULL if the cache is missing or stale */
+lval *cache_load(char *filename, unsigned long long hash)
+{
+  char *name = cache_name(filename);
+  size_t len;
+  unsigned char *data = file_map(name, &len);
+  lfree(name);
+  if (data == NULL)
+  {
+    return NULL;
+  }
+
+  lbuf header = {NULL, 0, 0};
+  cache_header(&header, hash);
+  lval *forms = NULL;
+  if (len >= header.len && memcmp(data, header.data, header.len) == 0)
+  {
+    lreader r;
+    lreader_init(&r, data + header.len, len - header.len, NULL);
+    long count = lreader_count(&r);
+    lreader_begin(&r);
+    forms = lval_sexpr();
+    for (long i = 0; i < count && !r.bad; i++)
+    {
+      forms = lval_add(forms, lval_read_bin(&r));
+    }
+    lreader_end(&r);
+    if (r.bad || r.pos != r.end)
+    {
+      lval_del(forms);
+      forms = NULL;
+    }
+  }
+  lfree(header.data);
+  file_unmap(data, len);
+  return forms;
+}
+
+/* Write the cache through a temporary file so a reader never sees half of it */
+void cache_save(char *filename, unsigned long long hash, long count, lwriter *forms)
+{
+  /* Per process, as fork-server workers may load the same file at once */
+  char *name = cache_name(filename);
+  char *tmp = lmalloc(strlen(name) + 32);
+#ifdef _WIN32
+  sprintf(tmp, "%s.tmp", name);
+#else
+  sprintf(tmp, "%s.%ld.tmp", name, (long)getpid());
+#endif
+
+  lbuf header = {NULL, 0, 0};
+  cache_header(&header, hash);
+  lbuf_varint(&header, count);
+  lwriter_finish(forms, &header);
+  FILE *f = fopen(tmp, "wb");
+  if (f != NULL)
+  {
+    int ok = fwrite(header.data, 1, header.len, f) == header.len;
+    ok = fclose(f) == 0 && ok;
+    if (!ok || rename(tmp, name) != 0)
+    {
+      remove(tmp);
+    }
+  }
+  lfree(header.data);
+  lfree(tmp);
+  lfree(name);
+}
+
+lval *lval_read_form(mpc_ast_t *t);
+void trace_error(void);
+/* Top-level forms of loaded files that evaluated to an error */
+unsigned long LoadErrors = 0;
+
+/* Evaluate a top-level form of a loaded file, printing it if it fails */
+void load_eval(lenv *e, lval *expr)
+{
+  /* Lambdas made by the form keep where it was */
+  int span = Source.span;
+  Source.span = expr->span;
+  long long start = now_ns();
+  lval *x = lval_eval(e, expr);
+  metrics_eval(now_ns() - start);
+  Source.span = span;
+  if (x->type == LVAL_ERR)
+  {
+    LoadErrors++;
+    trace_error();
+    lval_println(x);
+  }
+  lval_del(x);
+}
+
+// Lazy loading
+/*
+** With --lazy, load only scans a file for its top-level forms. A
+** (fun {name ...} ...) or (def {name} ...) form is kept as source text
+** under its name in the global (or module) environment and everything
+** else is evaluated as usual. The first lookup that misses there
+** parses and evaluates the form it needs, so definitions nobody uses
+** are never parsed at all.
+*/
+
+/* Set by --lazy */
+int LoadLazy = 0;
+
+/* Skip whitespace and comments */
+char *lazy_skip(char *s)
+{
+  while (*s)
+  {
+    if (isspace((unsigned char)*s))
+    {
+      s++;
+    }
+    else if (*s == ';')
+    {
+      while (*s && *s != '\r' && *s != '\n')
       {
-        lval_del(a);
-        return lval_err("Function format invalid. "
-                        "Symbol '&' not followed by single symbol.");
+        s++;
       }
-      lval *nsym = lval_pop(f->formals, 0);
-      lenv_put(f->env, nsym, builtin_list(e, a));
-      lval_del(sym);
-      lval_del(nsym);
+    }
+    else
+    {
       break;
     }
+  }
+  return s;
+}
 
-    lval *val = lval_pop(a, 0);
-    lenv_put(f->env, sym, val);
-    lval_del(sym);
-    lval_del(val);
+/* One past the closing quote of the string starting at s */
+char *lazy_string_end(char *s)
+{
+  for (s++; *s; s++)
+  {
+    if (*s == '\\' && s[1])
+    {
+      s++;
+    }
+    else if (*s == '"')
+    {
+      return s + 1;
+    }
   }
-  lval_del(a);
+  return NULL;
+}
+
+/* One past the end of the form starting at s, or NULL if it never closes */
+char *lazy_form_end(char *s)
+{
+  if (*s == '"')
+  {
+    return lazy_string_end(s);
+  }
+  if (*s != '(' && *s != '{')
+  {
+    while (*s && !isspace((unsigned char)*s) && !strchr("(){};\"", *s))
+    {
+      s++;
+    }
+    return s;
+  }
+
+  int depth = 0;
+  while (*s)
+  {
+    if (*s == '"')
+    {
+      if ((s = lazy_string_end(s)) == NULL)
+      {
+        return NULL;
+      }
+      continue;
+    }
+    if (*s == ';')
+    {
+      s = lazy_skip(s);
+      continue;
+    }
+    if (*s == '(' || *s == '{')
+    {
+      depth++;
+    }
+    if ((*s == ')' || *s == '}') && --depth == 0)
+    {
+      return s + 1;
+    }
+    s++;
+  }
+  return NULL;
+}
+
+/* The name a (fun {name ...} ...) or (def {name} ...) form defines, or NULL for any other form */
+char *lazy_name(char *s)
+{
+  s = lazy_skip(s + 1);
+  int def = strncmp(s, "def", 3) == 0;
+  if (!def && strncmp(s, "fun", 3) != 0)
+  {
+    return NULL;
+  }
+  if (!isspace((unsigned char)s[3]) && s[3] != '{')
+  {
+    return NULL;
+  }
+  s = lazy_skip(s + 3);
+  if (*s != '{')
+  {
+    return NULL;
+  }
+
+  char *name = s = lazy_skip(s + 1);
+  while (*s && strchr(SYMBOL_CHARS, *s))
+  {
+    s++;
+  }
+  size_t n = s - name;
+
+  /* Anything the reader would take as a boolean or a number first */
+  if (n == 0 || strncmp(name, "true", 4) == 0 || strncmp(name, "false", 5) == 0 ||
+      isdigit((unsigned char)name[0]) ||
+      ((name[0] == '+' || name[0] == '-') && isdigit((unsigned char)name[1])))
+  {
+    return NULL;
+  }
+
+  /* def may bind several names at once, only a single one is deferred */
+  char *after = lazy_skip(s);
+  if (def ? *after != '}' : (after == s && *s != '}'))
+  {
+    return NULL;
+  }
+
+  char *sym = lmalloc(n + 1);
+  memcpy(sym, name, n);
+  sym[n] = '\0';
+  return sym;
+}
+
+/*
+** Parse and evaluate the form of source text found on line, returning
+** an error only if it doesn't parse. Error rows are moved to match the
+** file, columns still count from the start of the form.
+*/
+lval *lazy_eval(lenv *e, char *filename, char *src, int line, int col)
+{
+  mpc_result_t r;
+  long long start = now_ns();
+  int ok = mpc_parse(filename, src, Expr, &r);
+  Metrics.parse_ns += now_ns() - start;
+  Metrics.parsed_bytes += strlen(src);
+  if (!ok)
+  {
+    r.error->state.row += line;
+    char *err_msg = mpc_err_string(r.error);
+    mpc_err_delete(r.error);
+    mpc_arena_clear(Arena);
+    lval *err = lval_err("Could not load Library %s", err_msg);
+    free(err_msg);
+    return err;
+  }
+
+  mpc_ast_t *t = r.output;
+  if (t->id == RULE_COMMENT)
+  {
+    mpc_arena_clear(Arena);
+    return NULL;
+  }
+  int file = Source.file, row = Source.row, column = Source.col;
+  Source.file = source_file(filename);
+  Source.row = line;
+  Source.col = col;
+  lval *expr = lval_read_form(t);
+  mpc_arena_clear(Arena);
+  load_eval(e, expr);
+  Source.file = file;
+  Source.row = row;
+  Source.col = column;
+  return NULL;
+}
+
+/* Keep src to define sym later. Nothing may be deferred under that name yet */
+void lenv_put_lazy(lenv *e, char *sym, char *src, char *filename, int line, int col)
+{
+  if (e->lazy == NULL)
+  {
+    e->lazy = lcalloc(1, sizeof(llazy));
+  }
+  llazy *l = e->lazy;
+
+  char *copy = lmalloc(strlen(src) + 1);
+  strcpy(copy, src);
+  l->count++;
+  l->syms = lrealloc(l->syms, sizeof(char *) * l->count);
+  l->srcs = lrealloc(l->srcs, sizeof(char *) * l->count);
+  l->files = lrealloc(l->files, sizeof(char *) * l->count);
+  l->lines = lrealloc(l->lines, sizeof(int) * l->count);
+  l->cols = lrealloc(l->cols, sizeof(int) * l->count);
+  l->syms[l->count - 1] = lmalloc(strlen(sym) + 1);
+  strcpy(l->syms[l->count - 1], sym);
+  l->srcs[l->count - 1] = copy;
+  l->files[l->count - 1] = lmalloc(strlen(filename) + 1);
+  strcpy(l->files[l->count - 1], filename);
+  l->lines[l->count - 1] = line;
+  l->cols[l->count - 1] = col;
+}
+
+/* Evaluate the deferred definition of sym, if there is one. e is the global or a module environment */
+int lenv_resolve_lazy(lenv *e, char *sym)
+{
+  llazy *l = e->lazy;
+  for (int i = 0; i < l->count; i++)
+  {
+    if (strcmp(l->syms[i], sym) != 0)
+    {
+      continue;
+    }
+
+    /* Take it out first so a definition that refers to itself can't loop */
+    char *name = l->syms[i];
+    char *src = l->srcs[i];
+    char *filename = l->files[i];
+    int line = l->lines[i];
+    int col = l->cols[i];
+    l->count--;
+    l->syms[i] = l->syms[l->count];
+    l->srcs[i] = l->srcs[l->count];
+    l->files[i] = l->files[l->count];
+    l->lines[i] = l->lines[l->count];
+    l->cols[i] = l->cols[l->count];
+
+    lval *err = lazy_eval(e, filename, src, line, col);
+    if (err)
+    {
+      lval_println(err);
+      lval_del(err);
+    }
+    lfree(name);
+    lfree(src);
+    lfree(filename);
+    return 1;
+  }
+  return 0;
+}
+
+/* Forget the deferred definition of sym without evaluating it */
+void lenv_drop_lazy(lenv *e, char *sym)
+{
+  llazy *l = e->lazy;
+  for (int i = 0; i < l->count; i++)
+  {
+    if (strcmp(l->syms[i], sym) == 0)
+    {
+      lfree(l->syms[i]);
+      lfree(l->srcs[i]);
+      lfree(l->files[i]);
+      l->count--;
+      l->syms[i] = l->syms[l->count];
+      l->srcs[i] = l->srcs[l->count];
+      l->files[i] = l->files[l->count];
+      l->lines[i] = l->lines[l->count];
+      l->cols[i] = l->cols[l->count];
+      return;
+    }
+  }
+}
+
+int lenv_bound(lenv *e, char *sym)
+{
+  for (int i = 0; i < e->count; i++)
+  {
+    if (strcmp(e->syms[i], sym) == 0)
+    {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+lval *load_lazy(lenv *e, char *filename)
+{
+  FILE *f = fopen(filename, "rb");
+  if (f == NULL)
+  {
+    return lval_err("Could not load Library %s: error: Unable to open file!", filename);
+  }
+  fseek(f, 0, SEEK_END);
+  long len = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  char *src = lmalloc(len > 0 ? len + 1 : 1);
+  len = (long)fread(src, 1, len > 0 ? len : 0, f);
+  src[len] = '\0';
+  fclose(f);
+
+  lenv *root = e;
+  while (root->parent && !root->module)
+  {
+    root = root->parent;
+  }
+
+  lval *result = NULL;
+  int line = 0;
+  char *counted = src;
+  char *row = src;
+  char *s = lazy_skip(src);
+  while (*s && result == NULL)
+  {
+    for (; counted < s; counted++)
+    {
+      if (*counted == '\n')
+      {
+        line++;
+        row = counted + 1;
+      }
+    }
+    int col = (int)(s - row);
+
+    char *end = lazy_form_end(s);
+    if (end == NULL || end == s)
+    {
+      /* Let the parser say what is wrong from here on */
+      result = lazy_eval(e, filename, s, line, col);
+      break;
+    }
+
+    char c = *end;
+    *end = '\0';
+    char *name = *s == '(' ? lazy_name(s) : NULL;
+    /* A redefinition may build on the earlier one, so that is settled first */
+    if (name && root->lazy)
+    {
+      lenv_resolve_lazy(root, name);
+    }
+    if (name && !lenv_bound(root, name))
+    {
+      lenv_put_lazy(root, name, s, filename, line, col);
+    }
+    else
+    {
+      result = lazy_eval(e, filename, s, line, col);
+    }
+    lfree(name);
+    *end = c;
+    s = lazy_skip(end);
+  }
+
+  lfree(src);
+  return result ? result : lval_sexpr();
+}
+
+lval *builtin_load(lenv *e, lval *a)
+{
+  LASSERT_NUM("load", a, 1);
+  LASSERT_TYPE("load", a, 0, LVAL_STR);
+
+  /* "-" loads from standard input */
+  char *filename = a->cell[0]->str;
+  NOTLISP_PROBE1(load__start, filename);
+  mpc_stream_t *s;
+  FILE *f = NULL;
+  unsigned long long hash = 0;
+  lwriter cache;
+  lwriter_init(&cache, NULL);
+  long cached = 0;
+  int caching = 0;
+  if (strcmp(filename, "-") == 0)
+  {
+    s = mpc_stream_pipe("<stdin>", stdin);
+  }
+  else
+  {
+    f = fopen(filename, "rb");
+    if (f == NULL)
+    {
+      lval *err = lval_err("Could not load Library %s: error: Unable to open file!",
+                           filename);
+      NOTLISP_PROBE2(load__done, filename, 0);
+      lval_del(a);
+      return err;
+    }
+
+    if (LoadLazy)
+    {
+      fclose(f);
+      lval *x = load_lazy(e, filename);
+      NOTLISP_PROBE2(load__done, filename, x->type != LVAL_ERR);
+      lval_del(a);
+      return x;
+    }
+
+    if (LoadCache)
+    {
+      hash = file_hash(f);
+      lval *forms = cache_load(filename, hash);
+      if (forms)
+      {
+        fclose(f);
+        for (int i = 0; i < forms->count; i++)
+        {
+          load_eval(e, forms->cell[i]);
+        }
+        lfree(forms->cell);
+        lfree(forms);
+        Heap.lval_frees++;
+        NOTLISP_PROBE2(load__done, filename, 1);
+        lval_del(a);
+        return lval_sexpr();
+      }
+      caching = 1;
+    }
+    s = mpc_stream_file(filename, f);
+  }
+
+  /* What is read here remembers where in the file it was */
+  int file = Source.file, row = Source.row;
+  Source.file = source_file(f ? filename : "<stdin>");
+  int column = Source.col;
+  Source.row = 0;
+  Source.col = 0;
+
+  /* Read and evaluate one top-level form at a time */
+  lval *result = lval_sexpr();
+  mpc_result_t r;
+  long long parse_ns = 0;
+  while (!mpc_stream_done(s))
+  {
+    long long start = now_ns();
+    int ok = mpc_stream_next(s, Expr, &r);
+    parse_ns += now_ns() - start;
+    if (!ok)
+    {
+      char *err_msg = mpc_err_string(r.error);
+      mpc_err_delete(r.error);
+      mpc_arena_clear(Arena);
+      lval_del(result);
+      result = lval_err("Could not load Library %s", err_msg);
+      free(err_msg);
+      caching = 0;
+      break;
+    }
+
+    /* Comments are forms on their own at the top level */
+    mpc_ast_t *t = r.output;
+    if (t->id == RULE_COMMENT)
+    {
+      mpc_arena_clear(Arena);
+      continue;
+    }
+
+    lval *expr = lval_read_form(t);
+    mpc_arena_clear(Arena);
+
+    if (caching)
+    {
+      lval_write(&cache, expr);
+      cached++;
+    }
+    load_eval(e, expr);
+  }
+  Source.file = file;
+  Source.row = row;
+  Source.col = column;
+
+  if (caching)
+  {
+    cache_save(filename, hash, cached, &cache);
+  }
+  lwriter_del(&cache);
+
+  Metrics.parsed_bytes += (unsigned long)mpc_stream_pos(s);
+  Metrics.parse_ns += parse_ns;
+  mpc_stream_delete(s);
+  if (f)
+  {
+    fclose(f);
+  }
+  NOTLISP_PROBE2(load__done, filename, result->type != LVAL_ERR);
+  lval_del(a);
+  return result;
+}
+
+// Modules
+/*
+** require evaluates a file once into an environment of its own, whose
+** parent is the global environment so it still sees the builtins and
+** the prelude, but whose definitions stay in it. Modules are kept by
+** canonical path for the rest of the run. What a module defines is
+** bound straight into the environment that requires it, and exported
+** functions carry the module so they run against its definitions
+** wherever they are called from.
+*/
+struct
+{
+  int count;
+  char **paths;
+  lenv **envs;
+} Modules;
+
+void modules_del(void)
+{
+  for (int i = 0; i < Modules.count; i++)
+  {
+    lfree(Modules.paths[i]);
+    lenv_del(Modules.envs[i]);
+  }
+  lfree(Modules.paths);
+  lfree(Modules.envs);
+  Modules.count = 0;
+}
+
+/* Free the first n modules, required under a global environment that is gone */
+void modules_drop(int n)
+{
+  for (int i = 0; i < n; i++)
+  {
+    lfree(Modules.paths[i]);
+    lenv_del(Modules.envs[i]);
+  }
+  Modules.count -= n;
+  memmove(Modules.paths, Modules.paths + n, sizeof(char *) * Modules.count);
+  memmove(Modules.envs, Modules.envs + n, sizeof(lenv *) * Modules.count);
+}
+
+/* The canonical path of filename, or NULL if it doesn't exist */
+char *module_path(char *filename)
+{
+#ifdef _WIN32
+  return _fullpath(NULL, filename, 0);
+#else
+  return realpath(filename, NULL);
+#endif
+}
+
+/* The module already required from path, or NULL */
+lenv *module_find(char *path)
+{
+  for (int i = 0; i < Modules.count; i++)
+  {
+    if (strcmp(Modules.paths[i], path) == 0)
+    {
+      return Modules.envs[i];
+    }
+  }
+  return NULL;
+}
+
+/* The path module m was required from, or NULL */
+char *module_name(lenv *m)
+{
+  for (int i = 0; i < Modules.count; i++)
+  {
+    if (Modules.envs[i] == m)
+    {
+      return Modules.paths[i];
+    }
+  }
+  return NULL;
+}
+
+void module_add(char *path, lenv *m)
+{
+  Modules.count++;
+  Modules.paths = lrealloc(Modules.paths, sizeof(char *) * Modules.count);
+  Modules.envs = lrealloc(Modules.envs, sizeof(lenv *) * Modules.count);
+  Modules.paths[Modules.count - 1] = lmalloc(strlen(path) + 1);
+  strcpy(Modules.paths[Modules.count - 1], path);
+  Modules.envs[Modules.count - 1] = m;
+}
+
+/* The environment of the module at path, loading it the first time */
+lval *module_load(lenv *e, char *path, lenv **module)
+{
+  *module = module_find(path);
+  if (*module)
+  {
+    return NULL;
+  }
+
+  lenv *root = e;
+  while (root->parent)
+  {
+    root = root->parent;
+  }
+  lenv *m = lenv_new();
+  m->parent = root;
+  m->module = true;
+
+  /* Registered before it runs, so modules requiring each other see it half loaded */
+  module_add(path, m);
+
+  lval *x = builtin_load(m, lval_add(lval_sexpr(), lval_str(path)));
+  if (x->type == LVAL_ERR)
+  {
+    for (int i = 0; i < Modules.count; i++)
+    {
+      if (Modules.envs[i] == m)
+      {
+        lfree(Modules.paths[i]);
+        Modules.count--;
+        Modules.paths[i] = Modules.paths[Modules.count];
+        Modules.envs[i] = Modules.envs[Modules.count];
+        break;
+      }
+    }
+    lenv_del(m);
+    return x;
+  }
+  lval_del(x);
+
+  *module = m;
+  return NULL;
+}
+
+/* Bind the value of k in module m into e */
+void module_export(lenv *e, lenv *m, lval *k, lval *v)
+{
+  lval *x = lval_copy(v);
+  if (x->type == LVAL_FUN && !x->builtin && !x->module)
+  {
+    x->module = m;
+  }
+  lenv_put(e, k, x);
+  lval_del(x);
+}
+
+lval *builtin_require(lenv *e, lval *a)
+{
+  LASSERT(a, a->count == 1 || a->count == 2,
+          "Function 'require' passed incorrect number of arguments. "
+          "Got %i, Expected 1 or 2.",
+          a->count);
+  LASSERT_TYPE("require", a, 0, LVAL_STR);
+  if (a->count == 2)
+  {
+    LASSERT_TYPE("require", a, 1, LVAL_QEXPR);
+    for (int i = 0; i < a->cell[1]->count; i++)
+    {
+      LASSERT(a, a->cell[1]->cell[i]->type == LVAL_SYM,
+              "Function 'require' cannot import non-symbol. "
+              "Got %s, Expected %s.",
+              ltype_name(a->cell[1]->cell[i]->type), ltype_name(LVAL_SYM));
+    }
+  }
+
+  char *path = module_path(a->cell[0]->str);
+  if (path == NULL)
+  {
+    lval *err = lval_err("Could not require %s: error: Unable to open file!",
+                         a->cell[0]->str);
+    lval_del(a);
+    return err;
+  }
+
+  lenv *m;
+  lval *err = module_load(e, path, &m);
+  free(path);
+  if (err)
+  {
+    lval_del(a);
+    return err;
+  }
+
+  /* Everything the module defined, or just the names asked for */
+  if (a->count == 1)
+  {
+    while (m->lazy && m->lazy->count)
+    {
+      lenv_resolve_lazy(m, m->lazy->syms[0]);
+    }
+    for (int i = 0; i < m->count; i++)
+    {
+      lval *k = lval_sym(m->syms[i]);
+      module_export(e, m, k, m->vals[i]);
+      lval_del(k);
+    }
+  }
+  else
+  {
+    lval *names = a->cell[1];
+    for (int i = 0; i < names->count; i++)
+    {
+      if (m->lazy)
+      {
+        lenv_resolve_lazy(m, names->cell[i]->sym);
+      }
+      int j = 0;
+      while (j < m->count && strcmp(m->syms[j], names->cell[i]->sym) != 0)
+      {
+        j++;
+      }
+      if (j == m->count)
+      {
+        lval *missing = lval_err("Module %s does not define '%s'",
+                                 a->cell[0]->str, names->cell[i]->sym);
+        lval_del(a);
+        return missing;
+      }
+      module_export(e, m, names->cell[i], m->vals[j]);
+    }
+  }
+
+  lval_del(a);
+  return lval_sexpr();
+}
+
+/* Values written by serialize start with this, then the version */
+#define VALUE_MAGIC "NLSPV"
+
+void lenv_add_builtins(lenv *e);
+lval *builtin_serialize(lenv *e, lval *a)
+{
+  LASSERT_NUM("serialize", a, 2);
+  LASSERT_TYPE("serialize", a, 1, LVAL_STR);
+
+  lenv *builtins = lenv_new();
+  lenv_add_builtins(builtins);
+  lwriter w;
+  lwriter_init(&w, builtins);
+  lval_write(&w, a->cell[0]);
+
+  lbuf b = {NULL, 0, 0};
+  lbuf_bytes(&b, VALUE_MAGIC, sizeof(VALUE_MAGIC));
+  lbuf_byte(&b, BIN_VERSION);
+  lwriter_finish(&w, &b);
+  lwriter_del(&w);
+  lenv_del(builtins);
+
+  char *filename = a->cell[1]->str;
+  FILE *f = fopen(filename, "wb");
+  int ok = f != NULL && fwrite(b.data, 1, b.len, f) == b.len;
+  if (f != NULL && fclose(f) != 0)
+  {
+    ok = 0;
+  }
+  lfree(b.data);
+
+  lval *x = ok ? lval_sexpr() : lval_err("Could not serialize to %s", filename);
+  lval_del(a);
+  return x;
+}
+
+lval *builtin_deserialize(lenv *e, lval *a)
+{
+  LASSERT_NUM("deserialize", a, 1);
+  LASSERT_TYPE("deserialize", a, 0, LVAL_STR);
+
+  char *filename = a->cell[0]->str;
+  size_t len;
+  unsigned char *data = file_map(filename, &len);
+  if (data == NULL)
+  {
+    lval *err = lval_err("Could not deserialize %s: error: Unable to open file!", filename);
+    lval_del(a);
+    return err;
+  }
+
+  lval *x = NULL;
+  size_t header = sizeof(VALUE_MAGIC) + 1;
+  if (len >= header && memcmp(data, VALUE_MAGIC, sizeof(VALUE_MAGIC)) == 0 &&
+      data[sizeof(VALUE_MAGIC)] == BIN_VERSION)
+  {
+    lreader r;
+    lreader_init(&r, data + header, len - header, lenv_new());
+    lenv_add_builtins(r.builtins);
+    lreader_begin(&r);
+    x = lval_read_bin(&r);
+    if (r.pos != r.end)
+    {
+      r.bad = 1;
+    }
+    lenv *root = e;
+    while (root->parent)
+    {
+      root = root->parent;
+    }
+    lreader_modules(&r, root);
+    lreader_end(&r);
+    lenv_del(r.builtins);
+    if (r.bad)
+    {
+      lval_del(x);
+      x = NULL;
+    }
+  }
+  file_unmap(data, len);
+
+  if (x == NULL)
+  {
+    x = lval_err("Could not deserialize %s: error: Not a serialized value!", filename);
+  }
+  lval_del(a);
+  return x;
+}
+
+lval *builtin_print(lenv *e, lval *a)
+{
+
+  /* Print each argument followed by a space */
+  for (int i = 0; i < a->count; i++)
+  {
+    lval_render(&PrintBuf, a->cell[i]);
+    lbuf_byte(&PrintBuf, ' ');
+  }
+
+  /* Print a newline and delete arguments */
+  lbuf_byte(&PrintBuf, '\n');
+  lval_flush();
+  lval_del(a);
+
+  return lval_sexpr();
+}
+
+lval *builtin_to_string(lenv *e, lval *a)
+{
+  LASSERT_NUM("to-string", a, 1);
+
+  lbuf b = {NULL, 0, 0};
+  lval_render(&b, a->cell[0]);
+  lbuf_byte(&b, '\0');
+  lval *x = lval_str((char *)b.data);
+  lfree(b.data);
+  lval_del(a);
+  return x;
+}
+
+// Benchmarks
+
+/* Nanoseconds on a clock that never goes backwards */
+long long now_ns(void)
+{
+#ifdef _WIN32
+  return (long long)clock() * (1000000000LL / CLOCKS_PER_SEC);
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+#endif
+}
+
+/* Set by --bench, which collects results as JSON objects here instead of printing them */
+int BenchJson = 0;
+lbuf BenchOut;
+
+/* With --bench the real stdout, kept for the JSON while stdout itself goes to stderr */
+FILE *BenchStdout = NULL;
+
+int cmp_ns(const void *a, const void *b)
+{
+  long long x = *(const long long *)a, y = *(const long long *)b;
+  return (x > y) - (x < y);
+}
+
+void lbuf_json_string(lbuf *b, const char *s)
+{
+  lbuf_byte(b, '"');
+  for (; *s; s++)
+  {
+    if (*s == '"' || *s == '\\')
+    {
+      lbuf_byte(b, '\\');
+      lbuf_byte(b, (unsigned char)*s);
+    }
+    else if ((unsigned char)*s < 0x20)
+    {
+      char esc[8];
+      sprintf(esc, "\\u%04x", (unsigned char)*s);
+      lbuf_str(b, esc);
+    }
+    else
+    {
+      lbuf_byte(b, (unsigned char)*s);
+    }
+  }
+  lbuf_byte(b, '"');
+}
+
+void lbuf_json_field(lbuf *b, const char *key, long long x)
+{
+  lbuf_str(b, ", \"");
+  lbuf_str(b, key);
+  lbuf_str(b, "\": ");
+  lbuf_long(b, (long)x);
+}
+
+/* Start the JSON object of the next bench in BenchOut */
+void bench_entry(char *name)
+{
+  if (BenchOut.len)
+  {
+    lbuf_str(&BenchOut, ",\n    ");
+  }
+  lbuf_str(&BenchOut, "{\"name\": ");
+  lbuf_json_string(&BenchOut, name);
+}
+
+/* Report a bench whose expression failed, and pass the error on */
+lval *bench_failed(lval *a, lval *err)
+{
+  if (BenchJson)
+  {
+    bench_entry(a->cell[0]->str);
+    lbuf_str(&BenchOut, ", \"error\": ");
+    lbuf_json_string(&BenchOut, err->err);
+    lbuf_byte(&BenchOut, '}');
+  }
+  lval_del(a);
+  return err;
+}
+
+/* (bench "name" n {expr}) evaluates expr n times after a warmup and reports the times */
+lval *builtin_bench(lenv *e, lval *a)
+{
+  LASSERT_NUM("bench", a, 3);
+  LASSERT_TYPE("bench", a, 0, LVAL_STR);
+  LASSERT_TYPE("bench", a, 1, LVAL_NUM);
+  LASSERT_TYPE("bench", a, 2, LVAL_QEXPR);
+  LASSERT(a, a->cell[1]->num > 0,
+          "Function 'bench' needs at least one run. Got %li.", a->cell[1]->num);
+
+  char *name = a->cell[0]->str;
+  long n = a->cell[1]->num;
+  lval *body = a->cell[2];
+  body->type = LVAL_SEXPR;
+
+  /* A tenth as many runs again to warm up, errors stop it early */
+  for (long i = 0; i < n / 10 + 1; i++)
+  {
+    lval *x = lval_eval(e, lval_copy(body));
+    if (x->type == LVAL_ERR)
+    {
+      return bench_failed(a, x);
+    }
+    lval_del(x);
+  }
+
+  long long *times = lmalloc(sizeof(long long) * n);
+  unsigned long allocs = 0, bytes = 0;
+  for (long i = 0; i < n; i++)
+  {
+    lval *expr = lval_copy(body);
+    unsigned long count0 = Allocs.count, bytes0 = Allocs.bytes;
+    long long start = now_ns();
+    lval *x = lval_eval(e, expr);
+    times[i] = now_ns() - start;
+    allocs += Allocs.count - count0;
+    bytes += Allocs.bytes - bytes0;
+    if (x->type == LVAL_ERR)
+    {
+      lfree(times);
+      return bench_failed(a, x);
+    }
+    lval_del(x);
+  }
+
+  qsort(times, n, sizeof(long long), cmp_ns);
+  long long min = times[0];
+  long long median = times[n / 2];
+  long long p99 = times[(n * 99 + 99) / 100 - 1];
+  lfree(times);
+
+  if (BenchJson)
+  {
+    bench_entry(name);
+    lbuf_json_field(&BenchOut, "runs", n);
+    lbuf_json_field(&BenchOut, "min_ns", min);
+    lbuf_json_field(&BenchOut, "median_ns", median);
+    lbuf_json_field(&BenchOut, "p99_ns", p99);
+    lbuf_json_field(&BenchOut, "allocs_per_run", allocs / n);
+    lbuf_json_field(&BenchOut, "bytes_per_run", bytes / n);
+    lbuf_byte(&BenchOut, '}');
+  }
+  else
+  {
+    printf("%s: %li runs, min %.3fus, median %.3fus, p99 %.3fus, %lu allocs, %lu bytes per run\n",
+           name, n, min / 1000.0, median / 1000.0, p99 / 1000.0, allocs / n, bytes / n);
+  }
+
+  /* {min median p99} in nanoseconds, then allocations and bytes per run */
+  lval *x = lval_qexpr();
+  x = lval_add(x, lval_num((long)min));
+  x = lval_add(x, lval_num((long)median));
+  x = lval_add(x, lval_num((long)p99));
+  x = lval_add(x, lval_num((long)(allocs / n)));
+  x = lval_add(x, lval_num((long)(bytes / n)));
+  lval_del(a);
+  return x;
+}
+
+/* Most memory the process has held so far, in kilobytes */
+long peak_rss_kb(void)
+{
+#ifdef _WIN32
+  return 0;
+#else
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+#ifdef __APPLE__
+  return ru.ru_maxrss / 1024;
+#else
+  return ru.ru_maxrss;
+#endif
+#endif
+}
+
+/*
+** Load filename with every bench in it reporting to one JSON document.
+** Returns 1 if the file or any form in it failed
+*/
+int bench_file(lenv *e, char *filename)
+{
+  BenchJson = 1;
+  BenchOut.len = 0;
+  unsigned long errors = LoadErrors;
+  lval *x = builtin_load(e, lval_add(lval_sexpr(), lval_str(filename)));
+  errors = LoadErrors - errors;
+  BenchJson = 0;
+
+  lbuf out = {NULL, 0, 0};
+  lbuf_str(&out, "{\n  \"file\": ");
+  lbuf_json_string(&out, filename);
+  if (x->type == LVAL_ERR)
+  {
+    lbuf_str(&out, ",\n  \"error\": ");
+    lbuf_json_string(&out, x->err);
+  }
+  else if (errors)
+  {
+    char msg[64];
+    snprintf(msg, sizeof(msg), "%lu form%s failed", errors, errors == 1 ? "" : "s");
+    lbuf_str(&out, ",\n  \"error\": ");
+    lbuf_json_string(&out, msg);
+  }
+  lbuf_str(&out, ",\n  \"peak_rss_kb\": ");
+  lbuf_long(&out, peak_rss_kb());
+  lbuf_str(&out, ",\n  \"benchmarks\": [");
+  if (BenchOut.len)
+  {
+    lbuf_str(&out, "\n    ");
+    lbuf_bytes(&out, BenchOut.data, BenchOut.len);
+    lbuf_str(&out, "\n  ");
+  }
+  lbuf_str(&out, "]\n}\n");
+  fflush(stdout);
+  FILE *f = BenchStdout ? BenchStdout : stdout;
+  fwrite(out.data, 1, out.len, f);
+  fflush(f);
+  lfree(out.data);
+  int failed = x->type == LVAL_ERR || errors;
+  lval_del(x);
+  return failed;
+}
+
+// Profiler
+
+/*
+** While profiling, lval_call keeps the names of the user functions being
+** evaluated on a stack of ids, and SIGPROF copies that stack into samples.
+** The handler only copies ids into memory set aside beforehand; samples are
+** folded into counts per distinct stack, by name, outside of it.
+*/
+#define PROF_DEPTH 1024
+#define PROF_SAMPLES (1 << 20)
+#define PROF_INTERVAL_US 1000
+
+struct
+{
+  volatile sig_atomic_t on;
+  /* Frames past PROF_DEPTH still count, but only the outermost are sampled */
+  volatile int depth;
+  volatile long stack[PROF_DEPTH];
+  lsymtab names;
+
+  long *samples;
+  volatile long len;
+  unsigned long dropped;
+
+  lsymtab stacks;
+  unsigned long *counts;
+} Prof;
+
+void prof_sample(int sig)
+{
+  int depth = Prof.depth < PROF_DEPTH ? Prof.depth : PROF_DEPTH;
+  long len = Prof.len;
+  if (len + depth + 1 > PROF_SAMPLES)
+  {
+    Prof.dropped++;
+    return;
+  }
+  Prof.samples[len] = depth;
+  for (int i = 0; i < depth; i++)
+  {
+    Prof.samples[len + 1 + i] = Prof.stack[i];
+  }
+  Prof.len = len + depth + 1;
+}
+
+#ifndef _WIN32
+/* Move the samples taken so far into the counts, with SIGPROF held off meanwhile */
+void prof_drain(void)
+{
+  sigset_t set, old;
+  sigemptyset(&set);
+  sigaddset(&set, SIGPROF);
+  sigprocmask(SIG_BLOCK, &set, &old);
+
+  lbuf b = {NULL, 0, 0};
+  for (long i = 0; i < Prof.len; i += Prof.samples[i] + 1)
+  {
+    b.len = 0;
+    if (Prof.samples[i] == 0)
+    {
+      lbuf_str(&b, "(toplevel)");
+    }
+    for (long j = 0; j < Prof.samples[i]; j++)
+    {
+      if (j)
+      {
+        lbuf_byte(&b, ';');
+      }
+      lbuf_str(&b, Prof.names.names[Prof.samples[i + 1 + j]]);
+    }
+    lbuf_byte(&b, '\0');
+
+    long count = Prof.stacks.count;
+    long k = lsymtab_intern(&Prof.stacks, (char *)b.data);
+    if (Prof.stacks.count > count)
+    {
+      Prof.counts = lrealloc(Prof.counts, sizeof(unsigned long) * Prof.stacks.count);
+      Prof.counts[k] = 0;
+    }
+    Prof.counts[k]++;
+  }
+  lfree(b.data);
+  Prof.len = 0;
+
+  sigprocmask(SIG_SETMASK, &old, NULL);
+}
+
+/* Start sampling, with the counts of any earlier profile cleared */
+void prof_start(void)
+{
+  /* Not from lmalloc, so the buffer doesn't count against --max-heap */
+  if (Prof.samples == NULL)
+  {
+    Prof.samples = malloc(sizeof(long) * PROF_SAMPLES);
+  }
+  for (long i = 0; i < Prof.stacks.count; i++)
+  {
+    Prof.counts[i] = 0;
+  }
+  Prof.dropped = 0;
+  Prof.depth = 0;
+  Prof.on = 1;
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = prof_sample;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGPROF, &sa, NULL);
+
+  struct itimerval t = {{0, PROF_INTERVAL_US}, {0, PROF_INTERVAL_US}};
+  setitimer(ITIMER_PROF, &t, NULL);
+}
+
+void prof_stop(void)
+{
+  struct itimerval t = {{0, 0}, {0, 0}};
+  setitimer(ITIMER_PROF, &t, NULL);
+  signal(SIGPROF, SIG_IGN);
+  Prof.on = 0;
+  prof_drain();
+}
+#else
+void prof_drain(void) {}
+void prof_start(void) {}
+void prof_stop(void) {}
+#endif
+
+void prof_enter(lval *f)
+{
+  if (Prof.depth < PROF_DEPTH)
+  {
+    Prof.stack[Prof.depth] = lsymtab_intern(&Prof.names, func_label(f));
+  }
+  Prof.depth++;
+  if (Prof.len > PROF_SAMPLES / 2)
+  {
+    prof_drain();
+  }
+}
+
+/* Collapsed stacks, one "a;b;c count" line each, of the counts past the first from */
+void prof_collapse(lbuf *b, unsigned long *from, long nfrom)
+{
+  for (long i = 0; i < Prof.stacks.count; i++)
+  {
+    unsigned long n = Prof.counts[i] - (i < nfrom ? from[i] : 0);
+    if (n)
+    {
+      lbuf_str(b, Prof.stacks.names[i]);
+      lbuf_byte(b, ' ');
+      lbuf_long(b, (long)n);
+      lbuf_byte(b, '\n');
+    }
+  }
+}
+
+void prof_del(void)
+{
+  lsymtab_del(&Prof.names);
+  lsymtab_del(&Prof.stacks);
+  free(Prof.samples);
+  lfree(Prof.counts);
+}
+
+/* Set by --profile, which writes the stacks of everything after it to this file at exit */
+char *ProfileFile = NULL;
+
+void prof_write(char *filename)
+{
+  prof_stop();
+  lbuf b = {NULL, 0, 0};
+  prof_collapse(&b, NULL, 0);
+  FILE *f = fopen(filename, "wb");
+  if (f == NULL)
+  {
+    printf("Could not write profile %s\n", filename);
+  }
+  else
+  {
+    /* With no samples b.data is NULL, which fwrite must not be given even for 0 bytes */
+    if (b.len)
+    {
+      fwrite(b.data, 1, b.len, f);
+    }
+    fclose(f);
+  }
+  if (Prof.dropped)
+  {
+    fprintf(stderr, "profile: %lu samples dropped\n", Prof.dropped);
+  }
+  lfree(b.data);
+}
+
+/* (profile {expr}) evaluates expr with the profiler on and returns its collapsed stacks */
+lval *builtin_profile(lenv *e, lval *a)
+{
+#ifdef _WIN32
+  lval_del(a);
+  return lval_err("Function 'profile' needs SIGPROF, which this platform lacks.");
+#else
+  LASSERT_NUM("profile", a, 1);
+  LASSERT_TYPE("profile", a, 0, LVAL_QEXPR);
+
+  /* Under --profile the counts so far belong to it, so only report what is added */
+  int outer = Prof.on;
+  long nfrom = 0;
+  unsigned long *from = NULL;
+  if (outer)
+  {
+    prof_drain();
+    nfrom = Prof.stacks.count;
+    from = lmalloc(sizeof(unsigned long) * (nfrom + 1));
+    memcpy(from, Prof.counts, sizeof(unsigned long) * nfrom);
+  }
+  else
+  {
+    prof_start();
+  }
+
+  lval *body = lval_take(a, 0);
+  body->type = LVAL_SEXPR;
+  lval *x = lval_eval(e, body);
+
+  if (outer)
+  {
+    prof_drain();
+  }
+  else
+  {
+    prof_stop();
+  }
+  if (x->type == LVAL_ERR)
+  {
+    lfree(from);
+    return x;
+  }
+  lval_del(x);
+
+  lbuf b = {NULL, 0, 0};
+  prof_collapse(&b, from, nfrom);
+  lbuf_byte(&b, '\0');
+  x = lval_str((char *)b.data);
+  lfree(b.data);
+  lfree(from);
+  return x;
+#endif
+}
+
+/*
+** (profile-report nil) prints the calls counted under --call-stats so far.
+** The argument is ignored: a form with a function alone evaluates to it.
+*/
+lval *builtin_profile_report(lenv *e, lval *a)
+{
+  LASSERT(a, CallStats, "Function 'profile-report' needs calls counted with --call-stats.");
+  lbuf b = {NULL, 0, 0};
+  calls_report(&b);
+  fwrite(b.data, 1, b.len, stdout);
+  lfree(b.data);
+  lval_del(a);
+  return lval_sexpr();
+}
+
+// Trace
+/*
+** --trace FILE records every call and return with the time it happened
+** in a ring of TRACE_EVENTS, so a long run keeps only its latest stretch.
+** The ring is written to FILE when a form of a loaded file first fails,
+** and tracing stops there so the file ends with what led up to it;
+** otherwise it is written at exit. nlisp-trace turns it into Chrome
+** trace event JSON.
+*/
+#define TRACE_EVENTS (1 << 19)
+#define TRACE_MAGIC "NLTRACE"
+#define TRACE_VERSION 1
+
+enum
+{
+  TRACE_CALL,
+  TRACE_RETURN
+};
+
+typedef struct
+{
+  long long ns;
+  int id; /* The Funcs id of a lambda, or minus the id of a builtin */
+  int kind;
+} ltrace;
+
+struct
+{
+  int on;
+  char *file;
+  ltrace *events;
+  unsigned long count; /* Ever recorded, of which the ring keeps the last */
+} Trace;
+
+void trace_start(char *file)
+{
+  /* Like the profiler's samples, the ring is outside the heap --max-heap counts */
+  if (Trace.events == NULL)
+  {
+    Trace.events = malloc(sizeof(ltrace) * TRACE_EVENTS);
+  }
+  Trace.file = file;
+  Trace.count = 0;
+  Trace.on = 1;
+}
+
+void trace_event(int id, int kind)
+{
+  ltrace *t = &Trace.events[Trace.count++ & (TRACE_EVENTS - 1)];
+  t->ns = now_ns();
+  t->id = id;
+  t->kind = kind;
+}
+
+int trace_id(lval *f)
+{
+  if (f->builtin)
+  {
+    return -f->fn;
+  }
+  return f->fn ? f->fn : func_anon(f->span);
+}
+
+/*
+** The magic and version, the names and places of Funcs and the names of
+** the builtins, then how many events were dropped and how many follow,
+** each as its id, kind and nanoseconds since the one before.
+*/
+void trace_write(void)
+{
+  Trace.on = 0;
+  lbuf b = {NULL, 0, 0};
+  lbuf_bytes(&b, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+  lbuf_byte(&b, TRACE_VERSION);
+
+  lbuf_varint(&b, Funcs.keys.count);
+  lbuf where = {NULL, 0, 0};
+  for (long i = 0; i < Funcs.keys.count; i++)
+  {
+    where.len = 0;
+    if (Funcs.funcs[i].span)
+    {
+      lbuf_span(&where, Funcs.funcs[i].span);
+    }
+    lbuf_byte(&where, '\0');
+    lbuf_string(&b, Funcs.funcs[i].name);
+    lbuf_string(&b, (char *)where.data);
+  }
+  lfree(where.data);
+  lbuf_varint(&b, Metrics.nbuiltins);
+  for (int i = 0; i < Metrics.nbuiltins; i++)
+  {
+    lbuf_string(&b, Metrics.builtins[i]);
+  }
+
+  unsigned long n = Trace.count < TRACE_EVENTS ? Trace.count : TRACE_EVENTS;
+  lbuf_varint(&b, (long)(Trace.count - n));
+  lbuf_varint(&b, (long)n);
+  long long last = 0;
+  for (unsigned long i = Trace.count - n; i < Trace.count; i++)
+  {
+    ltrace *t = &Trace.events[i & (TRACE_EVENTS - 1)];
+    lbuf_varint(&b, t->id);
+    lbuf_byte(&b, (unsigned char)t->kind);
+    lbuf_varint(&b, i == Trace.count - n ? 0 : (long)(t->ns - last));
+    last = t->ns;
+  }
+
+  FILE *f = fopen(Trace.file, "wb");
+  if (f == NULL)
+  {
+    printf("Could not write trace %s\n", Trace.file);
+  }
+  else
+  {
+    fwrite(b.data, 1, b.len, f);
+    fclose(f);
+  }
+  lfree(b.data);
+}
+
+/* A loaded form failed: keep the trace of what led up to it */
+void trace_error(void)
+{
+  if (Trace.on)
+  {
+    trace_write();
+  }
+}
+
+void trace_del(void)
+{
+  free(Trace.events);
+}
+
+// Heap statistics
+
+/* Set by --alloc-stats, which prints heap_report at exit */
+int AllocStats = 0;
+
+/* Set by --lookup-stats, which prints lookup_report at exit */
+int LookupStats = 0;
+
+/* Written straight to out, so the report doesn't allocate and count itself */
+void heap_report(FILE *out)
+{
+  fprintf(out, "heap: %lu bytes live, %lu peak, %lu allocations of %lu bytes, %lu frees\n",
+          (unsigned long)Allocs.live, (unsigned long)Allocs.peak,
+          Allocs.count, Allocs.bytes, Allocs.frees);
+
+  unsigned long made = 0;
+  for (int t = 0; t <= LVAL_QEXPR; t++)
+  {
+    made += Heap.lvals[t];
+  }
+  fprintf(out, "lval: %lu made, %lu freed, %lu live, %lu copies, %lu lval_add reallocs\n",
+          made, Heap.lval_frees, made - Heap.lval_frees, Heap.lval_copies, Heap.lval_adds);
+
+  /* Types are as made: eval turns Q-Expressions into S-Expressions after */
+  for (int t = 0; t <= LVAL_QEXPR; t++)
+  {
+    fprintf(out, "  %-14s %lu\n", ltype_name(t), Heap.lvals[t]);
+  }
+
+  fprintf(out, "lenv: %lu made, %lu freed, %lu live, %lu copies\n",
+          Heap.lenvs, Heap.lenv_frees, Heap.lenvs - Heap.lenv_frees, Heap.lenv_copies);
+}
+
+/* (heap-stats nil) prints the allocation counts so far. Like profile-report it ignores its argument */
+lval *builtin_heap_stats(lenv *e, lval *a)
+{
+  lval_del(a);
+  heap_report(stdout);
+  return lval_sexpr();
+}
+
+/* How far lookups walked, in buckets that double, and how the global cache did */
+void lookup_report(FILE *out)
+{
+  unsigned long total = 0;
+  for (int d = 0; d <= LOOKUP_DEPTHS; d++)
+  {
+    total += Metrics.lookups[d];
+  }
+  fprintf(out, "lookups: %lu, %.1f parents walked on average\n",
+          total, total ? (double)Metrics.lookup_depths / total : 0.0);
+  for (int lo = 0; lo <= LOOKUP_DEPTHS; lo = lo ? lo * 2 : 1)
+  {
+    int hi = lo ? lo * 2 - 1 : 0;
+    unsigned long n = 0;
+    for (int d = lo; d <= hi && d <= LOOKUP_DEPTHS; d++)
+    {
+      n += Metrics.lookups[d];
+    }
+    if (n == 0)
+    {
+      continue;
+    }
+    char range[32];
+    if (lo == LOOKUP_DEPTHS)
+    {
+      snprintf(range, sizeof(range), "%i+", lo);
+    }
+    else if (lo == hi)
+    {
+      snprintf(range, sizeof(range), "%i", lo);
+    }
+    else
+    {
+      snprintf(range, sizeof(range), "%i-%i", lo, hi);
+    }
+    fprintf(out, "  %-10s %10lu %5.1f%%\n", range, n, 100.0 * n / total);
+  }
+
+  unsigned long global = Metrics.global_hits + Metrics.global_misses;
+  fprintf(out, "global cache: %lu hits, %lu misses, %.1f%% hit\n",
+          Metrics.global_hits, Metrics.global_misses,
+          global ? 100.0 * Metrics.global_hits / global : 0.0);
+}
+
+/* (lookup-stats nil) prints the lookup counts so far, ignoring its argument */
+lval *builtin_lookup_stats(lenv *e, lval *a)
+{
+  lval_del(a);
+  lookup_report(stdout);
+  return lval_sexpr();
+}
+
+/* The metrics as Prometheus text, to serve or write out */
+lval *builtin_metrics(lenv *e, lval *a)
+{
+  lval_del(a);
+  lbuf b = {NULL, 0, 0};
+  metrics_report(&b);
+  lbuf_byte(&b, '\0');
+  lval *x = lval_str((char *)b.data);
+  lfree(b.data);
+  return x;
+}
+
+lval *builtin_error(lenv *e, lval *a)
+{
+  LASSERT_NUM("error", a, 1);
+  LASSERT_TYPE("error", a, 0, LVAL_STR);
+
+  /* Construct Error from first argument */
+  lval *err = lval_err(a->cell[0]->str);
+
+  /* Delete arguments and return */
+  lval_del(a);
+  return err;
+}
+
+int lval_eq(lval *x, lval *y)
+{
+  if (x->type != y->type)
+  {
+    return 0;
+  }
+
+  switch (x->type)
+  {
+  case LVAL_NUM:
+  case LVAL_BOOl:
+    return (x->num == y->num);
+  case LVAL_STR:
+    return (strcmp(x->str, y->str) == 0);
+  case LVAL_ERR:
+    return (strcmp(x->err, y->err) == 0);
+  case LVAL_SYM:
+    return (strcmp(x->sym, y->sym) == 0);
+  case LVAL_FUN:
+    if (x->builtin || y->builtin)
+    {
+      return x->builtin == y->builtin;
+    }
+    else
+    {
+      return lval_eq(x->formals, y->formals) && lval_eq(x->body, y->body);
+    }
+  case LVAL_SEXPR:
+  case LVAL_QEXPR:
+    if (x->count != y->count)
+    {
+      return 0;
+    }
+    for (int i = 0; i < x->count; i++)
+    {
+      if (!lval_eq(x->cell[i], y->cell[i]))
+      {
+        return 0;
+      }
+    }
+    return 1;
+    break;
+  }
+  return 0;
+}
+
+lval *builtin_cmp(lenv *e, lval *a, char *op)
+{
+  int r;
+  if (strcmp(op, "==") == 0)
+  {
+    r = lval_eq(a->cell[0], a->cell[1]);
+  }
+  if (strcmp(op, "!=") == 0)
+  {
+    r = !lval_eq(a->cell[0], a->cell[1]);
+  }
+  lval_del(a);
+  return lval_num(r);
+}
+
+lval *builtin_eq(lenv *e, lval *a)
+{
+  return builtin_cmp(e, a, "==");
+}
+
+lval *builtin_ne(lenv *e, lval *a)
+{
+  return builtin_cmp(e, a, "!=");
+}
+
+lval *builtin_if(lenv *e, lval *a)
+{
+  LASSERT_NUM("if", a, 3);
+  LASSERT_TYPE("if", a, 1, LVAL_QEXPR);
+  LASSERT_TYPE("if", a, 2, LVAL_QEXPR);
+
+  /* Mark Both Expressions as evaluable */
+  lval *x;
+  a->cell[1]->type = LVAL_SEXPR;
+  a->cell[2]->type = LVAL_SEXPR;
+
+  if (a->cell[0]->num)
+  {
+    x = lval_eval(e, lval_pop(a, 1));
+  }
+  else
+  {
+    x = lval_eval(e, lval_pop(a, 2));
+  }
+
+  lval_del(a);
+  return x;
+}
+
+lval *builtin_and(lenv *e, lval *a)
+{
+  LASSERT_NUM("&&", a, 2);
+
+  int x;
+  if (a->cell[0]->type == LVAL_QEXPR)
+  {
+    a->cell[0]->type = LVAL_SEXPR;
+  }
+
+  if (a->cell[1]->type == LVAL_QEXPR)
+  {
+    a->cell[1]->type = LVAL_SEXPR;
+  }
+
+  lval *b = lval_eval(e, lval_pop(a, 0));
+  lval *c = lval_eval(e, lval_pop(a, 0));
+  x = (b->num && c->num);
+  return lval_bool(x);
+}
+
+lval *builtin_or(lenv *e, lval *a)
+{
+  LASSERT_NUM("||", a, 2);
+
+  int x;
+  if (a->cell[0]->type == LVAL_QEXPR)
+  {
+    a->cell[0]->type = LVAL_SEXPR;
+  }
+
+  if (a->cell[1]->type == LVAL_QEXPR)
+  {
+    a->cell[1]->type = LVAL_SEXPR;
+  }
+
+  lval *b = lval_eval(e, lval_pop(a, 0));
+  lval *c = lval_eval(e, lval_pop(a, 0));
+  x = (b->num || c->num);
+  return lval_bool(x);
+}
+
+lval *builtin_not(lenv *e, lval *a)
+{
+  LASSERT_NUM("!", a, 1);
+  int x;
+  if (a->cell[0]->type == LVAL_QEXPR)
+  {
+    a->cell[0]->type = LVAL_SEXPR;
+  }
+
+  lval *b = lval_eval(e, lval_pop(a, 0));
+  x = !b->num;
+  return lval_bool(x);
+}
+
+lval *builtin_var(lenv *e, lval *a, char *func)
+{
+  LASSERT_TYPE(func, a, 0, LVAL_QEXPR);
+
+  lval *syms = a->cell[0];
+  for (int i = 0; i < syms->count; i++)
+  {
+    LASSERT(a, (syms->cell[i]->type == LVAL_SYM),
+            "Function '%s' cannot define non-symbol. "
+            "Got %s, Expected %s.",
+            func,
+            ltype_name(syms->cell[i]->type), ltype_name(LVAL_SYM));
+  }
+
+  LASSERT(a, (syms->count == a->count - 1),
+          "Function '%s' passed too many arguments for symbols. "
+          "Got %i, Expected %i.",
+          func, syms->count, a->count - 1);
+
+  for (int i = 0; i < syms->count; i++)
+  {
+    /* If 'def' define in globally. If 'put' define in locally */
+    if (strcmp(func, "def") == 0)
+    {
+      func_name(a->cell[i + 1], syms->cell[i]->sym);
+      lenv_def(e, syms->cell[i], a->cell[i + 1]);
+    }
+
+    if (strcmp(func, "=") == 0)
+    {
+      lenv_put(e, syms->cell[i], a->cell[i + 1]);
+    }
+  }
+
+  lval_del(a);
+  return lval_sexpr();
+}
+
+lval *builtin_def(lenv *e, lval *a)
+{
+  return builtin_var(e, a, "def");
+}
+
+lval *builtin_fun(lenv *e, lval *a)
+{
+  lval *sym = lval_pop(a->cell[0], 0);
+  lval *f = lval_lambda(lval_pop(a, 0), lval_pop(a, 0));
+  func_name(f, sym->sym);
+  lenv_put(e, sym, f);
+  lval_del(f);
+  lval_del(a);
+  lval_del(sym);
+  return lval_sexpr();
+}
+
+lval *builtin_put(lenv *e, lval *a)
+{
+  return builtin_var(e, a, "=");
+}
+
+void lenv_add_builtin(lenv *e, char *name, lbuiltin func)
+{
+  lval *k = lval_sym(name);
+  lval *v = lval_fun(func);
+  v->fn = metrics_builtin(name);
+  lenv_put(e, k, v);
+  lval_del(k);
+  lval_del(v);
+}
+
+void lenv_add_builtins(lenv *e)
+{
+  /* Function on Variables */
+  lenv_add_builtin(e, "def", builtin_def);
+  lenv_add_builtin(e, "fun", builtin_fun);
+
+  /* Functions on Lists */
+  lenv_add_builtin(e, "list", builtin_list);
+  lenv_add_builtin(e, "head", builtin_head);
+  lenv_add_builtin(e, "tail", builtin_tail);
+  lenv_add_builtin(e, "eval", builtin_eval);
+  lenv_add_builtin(e, "join", builtin_join);
+  lenv_add_builtin(e, "cons", builtin_cons);
+  lenv_add_builtin(e, "len", builtin_len);
+
+  /* Mathematical Functions */
+  lenv_add_builtin(e, "+", builtin_add);
+  lenv_add_builtin(e, "-", builtin_sub);
+  lenv_add_builtin(e, "*", builtin_mul);
+  lenv_add_builtin(e, "/", builtin_div);
+  lenv_add_builtin(e, "add", builtin_add);
+  lenv_add_builtin(e, "sub", builtin_sub);
+  lenv_add_builtin(e, "mul", builtin_mul);
+  lenv_add_builtin(e, "div", builtin_div);
+  lenv_add_builtin(e, "\\", builtin_lambda);
+
+  /* Define global  variables. */
+  lenv_add_builtin(e, "=", builtin_put);
+
+  /* Conditionals */
+  lenv_add_builtin(e, ">", builtin_gt);
+  lenv_add_builtin(e, "<", builtin_lt);
+  lenv_add_builtin(e, ">=", builtin_gte);
+  lenv_add_builtin(e, "<=", builtin_lte);
+  lenv_add_builtin(e, "==", builtin_eq);
+  lenv_add_builtin(e, "!=", builtin_ne);
+  lenv_add_builtin(e, "if", builtin_if);
+
+  /* Boolean logic */
+  lenv_add_builtin(e, "&&", builtin_and);
+  lenv_add_builtin(e, "||", builtin_or);
+  lenv_add_builtin(e, "!", builtin_not);
+
+  /* String Functions */
+  lenv_add_builtin(e, "load", builtin_load);
+  lenv_add_builtin(e, "require", builtin_require);
+  lenv_add_builtin(e, "serialize", builtin_serialize);
+  lenv_add_builtin(e, "deserialize", builtin_deserialize);
+  lenv_add_builtin(e, "error", builtin_error);
+  lenv_add_builtin(e, "print", builtin_print);
+  lenv_add_builtin(e, "to-string", builtin_to_string);
+  lenv_add_builtin(e, "bench", builtin_bench);
+  lenv_add_builtin(e, "profile", builtin_profile);
+  lenv_add_builtin(e, "profile-report", builtin_profile_report);
+  lenv_add_builtin(e, "heap-stats", builtin_heap_stats);
+  lenv_add_builtin(e, "metrics", builtin_metrics);
+  lenv_add_builtin(e, "lookup-stats", builtin_lookup_stats);
+}
+
+// Limits
+/*
+** --max-steps, --max-depth and --max-heap bound a job without killing
+** it. Each S-Expression evaluated burns one step of fuel and nests one
+** level deeper, and may only start while the interpreter's heap is under
+** its quota; running out of any unwinds with an error like any other.
+** The heap is checked there rather than in lmalloc, which can't fail, so
+** a single builtin may overshoot the quota by what it allocates itself.
+*/
+#define DEFAULT_MAX_DEPTH 10000
+struct
+{
+  long fuel;  /* Steps left */
+  long steps; /* What fuel is refilled to, 0 for no limit */
+  int depth;
+  int max_depth;
+  size_t heap;      /* Bytes a job may add to the heap, 0 for no limit */
+  size_t heap_live; /* What Allocs.live may reach before evaluation stops */
+  int hit;          /* A limit was reached, for the exit status */
+} Limits = {LONG_MAX, 0, 0, DEFAULT_MAX_DEPTH, 0, (size_t)-1, 0};
+
+/* Give a new job its full budget, on top of the heap in use so far */
+void limits_refill(void)
+{
+  Limits.fuel = Limits.steps ? Limits.steps : LONG_MAX;
+  Limits.heap_live = Limits.heap ? Allocs.live + Limits.heap : (size_t)-1;
+}
+
+/* Read a byte count, with an optional K, M or G suffix, into n. 0 if s isn't one */
+int limits_size(char *s, size_t *n)
+{
+  if (!isdigit((unsigned char)*s))
+  {
+    return 0;
+  }
+  char *end;
+  errno = 0;
+  unsigned long x = strtoul(s, &end, 10);
+  int shift = 0;
+  switch (*end)
+  {
+  case 'G': case 'g': shift = 30; end++; break;
+  case 'M': case 'm': shift = 20; end++; break;
+  case 'K': case 'k': shift = 10; end++; break;
+  }
+  if (*end || errno == ERANGE || x > (SIZE_MAX >> shift))
+  {
+    return 0;
+  }
+  *n = (size_t)x << shift;
+  return 1;
+}
+
+lval *limits_err(void)
+{
+  Limits.hit = 1;
+  if (Limits.fuel <= 0)
+  {
+    /* Stays empty, so whatever the job tries next fails too */
+    Limits.fuel = 0;
+    return lval_err("Evaluation step limit of %li reached", Limits.steps);
+  }
+  if (Allocs.live > Limits.heap_live)
+  {
+    return lval_err("Out of memory: heap quota of %lu bytes exceeded",
+                    (unsigned long)Limits.heap);
+  }
+  return lval_err("Recursion depth limit of %i reached", Limits.max_depth);
+}
+
+// Evaluation
+lval *lval_call(lenv *e, lval *f, lval *a)
+{
+  if (f->builtin)
+  {
+    Metrics.builtin_calls[f->fn]++;
+    int trace = Trace.on;
+    if (trace)
+    {
+      trace_event(-f->fn, TRACE_CALL);
+    }
+    NOTLISP_PROBE1(builtin__entry, Metrics.builtins[f->fn - 1]);
+    lval *x = f->builtin(e, a);
+    NOTLISP_PROBE1(builtin__return, Metrics.builtins[f->fn - 1]);
+    if (trace)
+    {
+      trace_event(-f->fn, TRACE_RETURN);
+    }
+    return x;
+  }
+  int given = a->count;
+  int total = f->formals->count;
+
+  while (a->count)
+  {
+    if (f->formals->count == 0)
+    {
+      lval_del(a);
+      return lval_err("Function passed too many arguments. "
+                      "Got %i, Expected %i.",
+                      given, total);
+    }
+
+    lval *sym = lval_pop(f->formals, 0);
+
+    if (strcmp(sym->sym, "&") == 0)
+    {
+      if (f->formals->count != 1)
+      {
+        lval_del(a);
+        return lval_err("Function format invalid. "
+                        "Symbol '&' not followed by single symbol.");
+      }
+      lval *nsym = lval_pop(f->formals, 0);
+      lenv_put(f->env, nsym, builtin_list(e, a));
+      lval_del(sym);
+      lval_del(nsym);
+      break;
+    }
+
+    lval *val = lval_pop(a, 0);
+    lenv_put(f->env, sym, val);
+    lval_del(sym);
+    lval_del(val);
+  }
+  lval_del(a);
+
+  if (f->formals->count > 0 &&
+      strcmp(f->formals->cell[0]->sym, "&") == 0)
+  {
+
+    /* Check to ensure that & is not passed invalidly. */
+    if (f->formals->count != 2)
+    {
+      return lval_err("Function format invalid. "
+                      "Symbol '&' not followed by single symbol.");
+    }
+
+    lval_del(lval_pop(f->formals, 0));
+    lval *sym = lval_pop(f->formals, 0);
+    lval *val = lval_qexpr();
+    lenv_put(f->env, sym, val);
+    lval_del(sym);
+    lval_del(val);
+  }
+
+  if (f->formals->count == 0)
+  {
+
+    f->env->parent = f->module ? f->module : e;
+    int prof = Prof.on, stats = CallStats;
+    int trace = Trace.on ? trace_id(f) : 0;
+    if (NOTLISP_ENABLED(call__entry))
+    {
+      NOTLISP_PROBE3(call__entry, func_label(f), source_name(span_at(f->span).file), span_at(f->span).line);
+    }
+    if (trace)
+    {
+      trace_event(trace, TRACE_CALL);
+    }
+    if (prof)
+    {
+      prof_enter(f);
+    }
+    if (stats)
+    {
+      calls_enter(f);
+    }
+    lval *x = builtin_eval(f->env,
+                           lval_add(lval_sexpr(), lval_copy(f->body)));
+    if (stats)
+    {
+      calls_leave();
+    }
+    if (prof)
+    {
+      Prof.depth--;
+    }
+    if (trace)
+    {
+      trace_event(trace, TRACE_RETURN);
+    }
+    if (NOTLISP_ENABLED(call__return))
+    {
+      NOTLISP_PROBE1(call__return, func_label(f));
+    }
+    return x;
+  }
+  else
+  {
+    return lval_copy(f);
+  }
+}
+
+lval *lval_eval_sexpr(lenv *e, lval *v)
+{
+  int span = v->span;
+  for (int i = 0; i < v->count; i++)
+  {
+    v->cell[i] = lval_eval(e, v->cell[i]);
+  }
+
+  for (int i = 0; i < v->count; i++)
+  {
+    if (v->cell[i]->type == LVAL_ERR)
+    {
+      return lval_take(v, i);
+    }
+  }
+
+  if (v->count == 0)
+  {
+    return v;
+  }
+  if (v->count == 1)
+  {
+    return lval_eval(e, lval_take(v, 0));
+  }
+
+  /* Ensure first element is a function after evaluation */
+  lval *f = lval_pop(v, 0);
+  if (f->type != LVAL_FUN)
+  {
+    lval *err = lval_err(
+        "S-Expression starts with incorrect type. "
+        "Got %s, Expected %s.",
+        ltype_name(f->type), ltype_name(LVAL_FUN));
+    err->span = span;
+    lval_del(f);
+    lval_del(v);
+    return err;
+  }
+
+  /* If so call function to get result */
+  lval *result = lval_call(e, f, v);
+  lval_del(f);
+
+  /* Errors point at the innermost form they came from */
+  if (result->type == LVAL_ERR && result->span == 0)
+  {
+    result->span = span;
+  }
+  return result;
+}
+
+lval *lval_eval(lenv *e, lval *v)
+{
+  if (v->type == LVAL_SYM)
+  {
+    /* Functions are shown by the name they were looked up by */
+    lval *x = lenv_get(e, v);
+    if (x->type == LVAL_FUN)
+    {
+      x->sym = lmalloc(strlen(v->sym) + 1);
+      strcpy(x->sym, v->sym);
+    }
+    else if (x->type == LVAL_ERR && x->span == 0)
+    {
+      x->span = v->span;
+    }
+    lval_del(v);
+    return x;
+  }
+
+  if (v->type == LVAL_SEXPR)
+  {
+    if (--Limits.fuel <= 0 || Limits.depth >= Limits.max_depth ||
+        Allocs.live > Limits.heap_live)
+    {
+      lval *err = limits_err();
+      err->span = v->span;
+      lval_del(v);
+      return err;
+    }
+    Metrics.evals++;
+    if (MetricsDump)
+    {
+      metrics_write();
+    }
+    Limits.depth++;
+    lval *x = lval_eval_sexpr(e, v);
+    Limits.depth--;
+    return x;
+  }
+  return v;
+}
+
+// Reading
+lval *lval_read_num(mpc_ast_t *t)
+{
+  errno = 0;
+  long x = strtol(t->contents, NULL, 10);
+  return errno != ERANGE ? lval_num(x) : lval_err("invalid number");
+}
+
+lval *lval_read_bool(mpc_ast_t *t)
+{
+  errno = 0;
+  int x = (strcmp(t->contents, "true") == 0);
+  return errno != ERANGE ? lval_bool(x) : lval_err("invalid number");
+}
+
+lval *lval_read_str(mpc_ast_t *t)
+{
+  t->contents[strlen(t->contents) - 1] = '\0';
+  /* Plain malloc, as mpcf_unescape reallocates it */
+  char *unescaped = malloc(strlen(t->contents + 1) + 1);
+  strcpy(unescaped, t->contents + 1);
+  unescaped = mpcf_unescape(unescaped);
+  lval *str = lval_str(unescaped);
+  free(unescaped);
+  return str;
+}
+
+lval *lval_read(mpc_ast_t *t);
+lval *lval_read_list(mpc_ast_t *t, lval *x)
+{
+  /* Fill this list with any valid expression contained within */
+  for (int i = 0; i < t->children_num; i++)
+  {
+    /* Brackets and anchors belong to no rule */
+    int id = t->children[i]->id;
+    if (id == 0 || id == RULE_COMMENT)
+    {
+      continue;
+    }
+    x = lval_add(x, lval_read(t->children[i]));
+  }
+
+  return x;
+}
+
+/* Symbols and expressions are what errors can point at, so only they get a span */
+lval *lval_read(mpc_ast_t *t)
+{
+  lval *x;
+  switch (t->id)
+  {
+  case RULE_NUMBER:
+    return lval_read_num(t);
+  case RULE_BOOLEAN:
+    return lval_read_bool(t);
+  case RULE_STRING:
+    return lval_read_str(t);
+  case RULE_SYMBOL:
+    x = lval_sym(t->contents);
+    break;
+  case RULE_QEXPR:
+    x = lval_read_list(t, lval_qexpr());
+    break;
+  default:
+    /* Root (>) or sexpr become an S-Expression */
+    x = lval_read_list(t, lval_sexpr());
+    break;
+  }
+  if (Source.file)
+  {
+    /* Text read from the middle of a line starts at Source.col */
+    int col = (int)t->state.col + 1 + (t->state.row == 0 ? Source.col : 0);
+    x->span = span_id(Source.file, Source.row + (int)t->state.row + 1, col);
+  }
+  return x;
+}
+
+/* A single form parsed with Expr may come wrapped in a root node */
+lval *lval_read_form(mpc_ast_t *t)
+{
+  if (t->id == 0 && t->children_num == 1)
+  {
+    return lval_read(t->children[0]);
+  }
+  return lval_read(t);
+}
+
+// Images
+/* The global environment, written once the prelude is loaded and read back by a later run */
+#define IMAGE_MAGIC "NLSPIMG"
+
+/* Write the bindings of e to filename */
+lval *image_save(lenv *e, char *filename)
+{
+  /* Deferred definitions only live in the source text, so bind them before writing */
+  while (e->lazy && e->lazy->count)
+  {
+    lenv_resolve_lazy(e, e->lazy->syms[0]);
+  }
+
+  lenv *builtins = lenv_new();
+  lenv_add_builtins(builtins);
+
+  lwriter w;
+  lwriter_init(&w, builtins);
+  lenv_write(&w, e);
+
+  lbuf b = {NULL, 0, 0};
+  lbuf_bytes(&b, IMAGE_MAGIC, sizeof(IMAGE_MAGIC));
+  lbuf_byte(&b, BIN_VERSION);
+  lwriter_finish(&w, &b);
+  lwriter_del(&w);
+  lenv_del(builtins);
+
+  FILE *f = fopen(filename, "wb");
+  if (f == NULL)
+  {
+    lfree(b.data);
+    return lval_err("Could not save image %s", filename);
+  }
+  size_t written = fwrite(b.data, 1, b.len, f);
+  int closed = fclose(f);
+  lfree(b.data);
+  if (written != b.len || closed != 0)
+  {
+    return lval_err("Could not write image %s", filename);
+  }
+  return lval_sexpr();
+}
+
+/* Read an environment back from an image in memory, NULL if it is damaged */
+lenv *image_read(const unsigned char *data, size_t len)
+{
+  size_t header = sizeof(IMAGE_MAGIC) + 1;
+  if (len < header || memcmp(data, IMAGE_MAGIC, sizeof(IMAGE_MAGIC)) != 0 ||
+      data[sizeof(IMAGE_MAGIC)] != BIN_VERSION)
+  {
+    return NULL;
+  }
+
+  lreader r;
+  lreader_init(&r, data + header, len - header, lenv_new());
+  r.fresh = 1;
+  lenv_add_builtins(r.builtins);
+  lreader_begin(&r);
+  lenv *e = lenv_read_bin(&r);
+  lreader_modules(&r, e);
+  lreader_end(&r);
+  lenv_del(r.builtins);
+
+  if (r.bad)
+  {
+    lenv_del(e);
+    return NULL;
+  }
+  return e;
+}
+
+/* Map filename and read the environment saved in it */
+lenv *image_load(char *filename)
+{
+  size_t len;
+  unsigned char *data = file_map(filename, &len);
+  if (data == NULL)
+  {
+    return NULL;
+  }
+  lenv *e = image_read(data, len);
+  file_unmap(data, len);
+  return e;
+}
+
+/* Read every form of a file without evaluating it and report the parser pool */
+void bench_parse(char *filename)
+{
+  FILE *f = fopen(filename, "rb");
+  if (f == NULL)
+  {
+    printf("Could not open %s\n", filename);
+    return;
+  }
+
+  mpc_mem_stats_t before, after;
+  mpc_mem_stats(&before);
+  clock_t start = clock();
+
+  long forms = 0;
+  mpc_stream_t *s = mpc_stream_file(filename, f);
+  mpc_result_t r;
+  while (!mpc_stream_done(s))
+  {
+    if (!mpc_stream_next(s, Expr, &r))
+    {
+      mpc_err_print(r.error);
+      mpc_err_delete(r.error);
+      break;
+    }
+    lval_del(lval_read_form(r.output));
+    mpc_arena_clear(Arena);
+    forms++;
+  }
+  mpc_stream_delete(s);
+  fclose(f);
+
+  double secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+  mpc_mem_stats(&after);
+  printf("forms: %li\n", forms);
+  printf("seconds: %f\n", secs);
+  printf("pool hits: %lu\n", after.hits - before.hits);
+  printf("pool misses: %lu\n", after.misses - before.misses);
+  printf("pool grows: %lu\n", after.grows - before.grows);
+}
+
+/* The grammar as the mpca_lang language, kept as the reference for grammar_build */
+static const char *NotLispyGrammar =
+    " boolean      : /true|false/ ;"
+    " string       : /\"(\\\\.|[^\"])*\"/ ;"
+    " comment      : /;[^\\r\\n]*/ ;"
+    " number       : /[+-]?([0-9]*[.])?[0-9]+/ ;"
+    " symbol       : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&|]+/ ;"
+    " sexpr        : '(' <expr>* ')' ;"
+    " qexpr        : '{' <expr>* '}' ;"
+    " expr         : <comment> | <string> | <boolean> | <number> | <symbol> | <sexpr> | <qexpr>;"
+    " notlispy     : /^/ <expr>* /$/ ;   ";
+
+void grammar_new(void)
+{
+  Number = mpc_new("number");
+  Boolean = mpc_new("boolean");
+  Symbol = mpc_new("symbol");
+  Sexpr = mpc_new("sexpr");
+  Qexpr = mpc_new("qexpr");
+  Expr = mpc_new("expr");
+  NotLispy = mpc_new("notlispy");
+  String = mpc_new("string");
+  Comment = mpc_new("comment");
+}
+
+void grammar_delete(void)
+{
+  mpc_cleanup(9, String, Comment, Boolean, Number, Symbol, Sexpr, Qexpr, Expr, NotLispy);
+}
+
+/* Define the parsers by compiling NotLispyGrammar at runtime */
+void grammar_build_lang(void)
+{
+  mpca_lang(MPCA_LANG_DEFAULT, NotLispyGrammar,
+            Comment, String, Boolean, Number, Symbol, Sexpr, Qexpr, Expr, NotLispy);
+}
+
+/* A regex literal in the grammar: a token whose text becomes the node contents */
+mpc_parser_t *grammar_regex(mpc_parser_t *p)
+{
+  return mpca_state(mpca_tag(mpc_apply(mpc_tok(p), mpcf_str_ast), "regex"));
+}
+
+/* A char literal in the grammar */
+mpc_parser_t *grammar_char(char c)
+{
+  return mpca_state(mpca_tag(mpc_apply(mpc_tok(mpc_char(c)), mpcf_str_ast), "char"));
+}
+
+/* Regex concatenation, folding the matched pieces into one string */
+mpc_parser_t *grammar_seq(int n, ...)
+{
+  va_list va;
+  va_start(va, n);
+  mpc_parser_t *p = mpc_lift(mpcf_ctor_str);
+  for (int i = 0; i < n; i++)
+  {
+    p = mpc_and(2, mpcf_strfold, p, va_arg(va, mpc_parser_t *), free);
+  }
+  va_end(va);
+  return p;
+}
+
+/* A sequence of grammar factors, shaped the way mpca_lang builds a term */
+mpc_parser_t *grammar_term(int n, ...)
+{
+  va_list va;
+  va_start(va, n);
+  mpc_parser_t *p = mpc_pass();
+  for (int i = 0; i < n; i++)
+  {
+    p = mpca_and(2, p, va_arg(va, mpc_parser_t *));
+  }
+  va_end(va);
+  return p;
+}
 
-  if (f->formals->count > 0 &&
-      strcmp(f->formals->cell[0]->sym, "&") == 0)
-  {
+void grammar_define(mpc_parser_t *p, mpc_parser_t *body)
+{
+  mpc_optimise(body);
+  mpc_define(p, body);
+}
 
-    /* Check to ensure that & is not passed invalidly. */
-    if (f->formals->count != 2)
-    {
-      return lval_err("Function format invalid. "
-                      "Symbol '&' not followed by single symbol.");
-    }
+/*
+** Define the parsers straight from combinators. This builds the
+** same parsers grammar_build_lang gets out of NotLispyGrammar,
+** down to the AST tags and rule ids, without parsing the grammar
+** language or compiling any regex at startup.
+*/
+void grammar_build(void)
+{
+  grammar_define(Boolean, grammar_term(1, grammar_regex(
+      mpc_or(2,
+             grammar_seq(4, mpc_char('t'), mpc_char('r'), mpc_char('u'), mpc_char('e')),
+             grammar_seq(5, mpc_char('f'), mpc_char('a'), mpc_char('l'), mpc_char('s'), mpc_char('e'))))));
+
+  grammar_define(String, grammar_term(1, grammar_regex(grammar_seq(3,
+      mpc_char('"'),
+      mpc_many(mpcf_strfold, mpc_or(2, grammar_seq(2, mpc_char('\\'), mpc_any()), mpc_noneof("\""))),
+      mpc_char('"')))));
+
+  grammar_define(Comment, grammar_term(1, grammar_regex(grammar_seq(2,
+      mpc_char(';'),
+      mpc_many(mpcf_strfold, mpc_noneof("\r\n"))))));
+
+  grammar_define(Number, grammar_term(1, grammar_regex(grammar_seq(3,
+      mpc_maybe_lift(mpc_oneof("+-"), mpcf_ctor_str),
+      mpc_maybe_lift(grammar_seq(2, mpc_many(mpcf_strfold, mpc_oneof("0123456789")), mpc_oneof(".")), mpcf_ctor_str),
+      mpc_many1(mpcf_strfold, mpc_oneof("0123456789"))))));
+
+  grammar_define(Symbol, grammar_term(1, grammar_regex(mpc_many1(mpcf_strfold,
+      mpc_oneof(SYMBOL_CHARS)))));
+
+  grammar_define(Sexpr, grammar_term(3,
+      grammar_char('('), mpca_many(mpca_ref(Expr, RULE_EXPR)), grammar_char(')')));
+
+  grammar_define(Qexpr, grammar_term(3,
+      grammar_char('{'), mpca_many(mpca_ref(Expr, RULE_EXPR)), grammar_char('}')));
+
+  grammar_define(Expr,
+      mpca_or(2, grammar_term(1, mpca_ref(Comment, RULE_COMMENT)),
+      mpca_or(2, grammar_term(1, mpca_ref(String, RULE_STRING)),
+      mpca_or(2, grammar_term(1, mpca_ref(Boolean, RULE_BOOLEAN)),
+      mpca_or(2, grammar_term(1, mpca_ref(Number, RULE_NUMBER)),
+      mpca_or(2, grammar_term(1, mpca_ref(Symbol, RULE_SYMBOL)),
+      mpca_or(2, grammar_term(1, mpca_ref(Sexpr, RULE_SEXPR)),
+                 grammar_term(1, mpca_ref(Qexpr, RULE_QEXPR)))))))));
+
+  grammar_define(NotLispy, grammar_term(3,
+      grammar_regex(mpc_and(2, mpcf_snd, mpc_soi(), mpc_lift(mpcf_ctor_str), free)),
+      mpca_many(mpca_ref(Expr, RULE_EXPR)),
+      grammar_regex(mpc_and(2, mpcf_snd, mpc_eoi(), mpc_lift(mpcf_ctor_str), free))));
+}
 
-    lval_del(lval_pop(f->formals, 0));
-    lval *sym = lval_pop(f->formals, 0);
-    lval *val = lval_qexpr();
-    lenv_put(f->env, sym, val);
-    lval_del(sym);
-    lval_del(val);
+/* Seconds of processor time taken by n runs of build */
+double bench_grammar(void (*build)(void), int n)
+{
+  clock_t start = clock();
+  for (int i = 0; i < n; i++)
+  {
+    grammar_delete();
+    grammar_new();
+    build();
   }
+  return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
 
-  if (f->formals->count == 0)
+/* Like mpc_ast_eq but also comparing the rule ids lval_read relies on */
+int ast_same(mpc_ast_t *a, mpc_ast_t *b)
+{
+  if (a->id != b->id || a->children_num != b->children_num)
   {
-
-    f->env->parent = e;
-    return builtin_eval(f->env,
-                        lval_add(lval_sexpr(), lval_copy(f->body)));
+    return 0;
   }
-  else
+  if (strcmp(a->tag, b->tag) != 0 || strcmp(a->contents, b->contents) != 0)
   {
-    return lval_copy(f);
+    return 0;
+  }
+  for (int i = 0; i < a->children_num; i++)
+  {
+    if (!ast_same(a->children[i], b->children[i]))
+    {
+      return 0;
+    }
   }
+  return 1;
 }
 
-lval *lval_eval_sexpr(lenv *e, lval *v)
+/* Time what main does before it can read the first form */
+void bench_startup(char *filename)
 {
-  for (int i = 0; i < v->count; i++)
+  int n = 200;
+
+  double lang = bench_grammar(grammar_build_lang, n);
+  double built = bench_grammar(grammar_build, n);
+
+  clock_t start = clock();
+  for (int i = 0; i < n; i++)
   {
-    v->cell[i] = lval_eval(e, v->cell[i]);
+    lenv *e = lenv_new();
+    lenv_add_builtins(e);
+    lenv_del(e);
   }
+  double env = (double)(clock() - start) / CLOCKS_PER_SEC;
 
-  for (int i = 0; i < v->count; i++)
+  printf("runs: %i\n", n);
+  printf("grammar (mpca_lang) ms: %f\n", lang * 1000 / n);
+  printf("grammar (static) ms: %f\n", built * 1000 / n);
+  printf("builtins ms: %f\n", env * 1000 / n);
+
+  /* Both grammars must read the file into the same tree */
+  FILE *f = fopen(filename, "rb");
+  if (f == NULL)
   {
-    if (v->cell[i]->type == LVAL_ERR)
-    {
-      return lval_take(v, i);
-    }
+    printf("Could not open %s\n", filename);
+    return;
   }
+  mpc_ast_arena(NULL);
 
-  if (v->count == 0)
+  mpc_result_t r;
+  mpc_ast_t *lang_ast = NULL;
+  grammar_delete();
+  grammar_new();
+  grammar_build_lang();
+  if (mpc_parse_file(filename, f, NotLispy, &r))
   {
-    return v;
+    lang_ast = r.output;
   }
-  if (v->count == 1)
+  else
   {
-    return lval_eval(e, lval_take(v, 0));
+    mpc_err_print(r.error);
+    mpc_err_delete(r.error);
   }
 
-  /* Ensure first element is a function after evaluation */
-  lval *f = lval_pop(v, 0);
-  if (f->type != LVAL_FUN)
+  rewind(f);
+  grammar_delete();
+  grammar_new();
+  grammar_build();
+  if (mpc_parse_file(filename, f, NotLispy, &r))
   {
-    lval *err = lval_err(
-        "S-Expression starts with incorrect type. "
-        "Got %s, Expected %s.",
-        ltype_name(f->type), ltype_name(LVAL_FUN));
-    lval_del(f);
-    lval_del(v);
-    return err;
+    printf("grammars agree: %s\n", lang_ast && ast_same(lang_ast, r.output) ? "yes" : "no");
+    mpc_ast_delete(r.output);
   }
-
-  /* If so call function to get result */
-  lval *result = lval_call(e, f, v);
-  lval_del(f);
-  return result;
-}
-
-lval *lval_eval(lenv *e, lval *v)
-{
-  if (v->type == LVAL_SYM)
+  else
   {
-    lval *x = lenv_get(e, v);
-    x->sym = malloc(strlen(v->sym) + 1);
-    strcpy(x->sym, v->sym);
-    lval_del(v);
-    return x;
+    mpc_err_print(r.error);
+    mpc_err_delete(r.error);
   }
-
-  if (v->type == LVAL_SEXPR)
+  if (lang_ast)
   {
-    return lval_eval_sexpr(e, v);
+    mpc_ast_delete(lang_ast);
   }
-  return v;
-}
 
-// Reading
-lval *lval_read_num(mpc_ast_t *t)
-{
-  errno = 0;
-  long x = strtol(t->contents, NULL, 10);
-  return errno != ERANGE ? lval_num(x) : lval_err("invalid number");
+  fclose(f);
+  mpc_ast_arena(Arena);
 }
 
-lval *lval_read_bool(mpc_ast_t *t)
+// Server
+/*
+** With --serve, the interpreter stays up once the files before it are
+** loaded and answers on a Unix domain socket. Each connection sends a
+** program and closes its side; it is evaluated in a fresh environment
+** under the global one, so its definitions vanish afterwards, and
+** everything it prints, results included, goes back down the socket.
+*/
+#ifndef _WIN32
+
+/* Everything the client sends, until it shuts down its side */
+char *serve_read(int fd)
 {
-  errno = 0;
-  int x = (strcmp(t->contents, "true") == 0);
-  return errno != ERANGE ? lval_bool(x) : lval_err("invalid number");
+  size_t len = 0, cap = 4096;
+  char *buf = lmalloc(cap);
+  ssize_t n;
+  while ((n = read(fd, buf + len, cap - len - 1)) > 0)
+  {
+    len += n;
+    if (len + 1 == cap)
+    {
+      cap *= 2;
+      buf = lrealloc(buf, cap);
+    }
+  }
+  buf[len] = '\0';
+  return buf;
 }
 
-lval *lval_read_str(mpc_ast_t *t)
+void serve_request(lenv *e, int fd)
 {
-  t->contents[strlen(t->contents) - 1] = '\0';
-  char *unescaped = malloc(strlen(t->contents + 1) + 1);
-  strcpy(unescaped, t->contents + 1);
-  unescaped = mpcf_unescape(unescaped);
-  lval *str = lval_str(unescaped);
-  free(unescaped);
-  return str;
-}
+  char *input = serve_read(fd);
 
-lval *lval_read(mpc_ast_t *t)
-{
+  /* Point stdout at the client while the program runs */
+  fflush(stdout);
+  int saved = dup(STDOUT_FILENO);
+  dup2(fd, STDOUT_FILENO);
 
-  /* If Symbol or Number return conversion to that type */
-  if (strstr(t->tag, "number"))
-  {
-    return lval_read_num(t);
-  }
-  if (strstr(t->tag, "boolean"))
+  lenv *child = lenv_new();
+  child->parent = e;
+  child->module = true;
+  limits_refill();
+
+  mpc_result_t r;
+  if (mpc_parse("<client>", input, NotLispy, &r))
   {
-    return lval_read_bool(t);
+    lval *x = lval_read(r.output);
+    mpc_arena_clear(Arena);
+    for (int i = 0; i < x->count; i++)
+    {
+      long long start = now_ns();
+      lval *y = lval_eval(child, x->cell[i]);
+      metrics_eval(now_ns() - start);
+      lval_println(y);
+      lval_del(y);
+    }
+    lfree(x->cell);
+    lfree(x);
+    Heap.lval_frees++;
   }
-  if (strstr(t->tag, "symbol"))
+  else
   {
-    return lval_sym(t->contents);
+    mpc_err_print(r.error);
+    mpc_err_delete(r.error);
+    mpc_arena_clear(Arena);
   }
+  lenv_del(child);
 
-  if (strstr(t->tag, "string"))
-  {
-    return lval_read_str(t);
-  }
+  fflush(stdout);
+  dup2(saved, STDOUT_FILENO);
+  close(saved);
+  lfree(input);
+}
 
-  /* If root (>) or sexpr then create empty list */
-  lval *x = NULL;
-  if (strcmp(t->tag, ">") == 0)
+void serve(lenv *e, char *path)
+{
+  struct sockaddr_un addr;
+  if (strlen(path) >= sizeof(addr.sun_path))
   {
-    x = lval_sexpr();
+    printf("Socket path too long: %s\n", path);
+    return;
   }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
 
-  if (strstr(t->tag, "sexpr"))
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  unlink(path);
+  if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 64) != 0)
   {
-    x = lval_sexpr();
+    printf("Could not listen on %s\n", path);
+    if (fd >= 0)
+    {
+      close(fd);
+    }
+    return;
   }
 
-  if (strstr(t->tag, "qexpr"))
-  {
-    x = lval_qexpr();
-  }
+  /* A client going away mid-answer is not our problem */
+  signal(SIGPIPE, SIG_IGN);
 
-  /* Fill this list with any valid expression contained within */
-  for (int i = 0; i < t->children_num; i++)
+  printf("Listening on %s\n", path);
+  fflush(stdout);
+  while (1)
   {
-
-    if (strstr(t->children[i]->tag, "comment"))
+    /* poll is never restarted, and the timeout covers a signal just before it */
+    struct pollfd p = {fd, POLLIN, 0};
+    int ready = poll(&p, 1, 1000);
+    if (MetricsDump)
     {
-      continue;
+      metrics_write();
     }
-    if (strcmp(t->children[i]->contents, "(") == 0)
+    if (ready <= 0)
     {
       continue;
     }
-    if (strcmp(t->children[i]->contents, ")") == 0)
+    int client = accept(fd, NULL, NULL);
+    if (client < 0)
     {
       continue;
     }
-    if (strcmp(t->children[i]->contents, "{") == 0)
+    serve_request(e, client);
+    close(client);
+  }
+}
+
+/*
+** With --fork-server, the files before it are loaded once and then
+** every line of standard input names a script to run. Each script gets
+** a fork of the warm process, sharing its heap copy-on-write, with up
+** to the given number running at once (0 means one per processor).
+** A script fails if it can't be read, any form in it fails or it runs
+** out of a limit; returns how many did.
+*/
+int fork_server(lenv *e, int workers)
+{
+  if (workers <= 0)
+  {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    workers = n > 0 ? (int)n : 1;
+  }
+
+  char line[4096];
+  int running = 0, failed = 0;
+  while (fgets(line, sizeof(line), stdin))
+  {
+    line[strcspn(line, "\r\n")] = '\0';
+    if (line[0] == '\0')
     {
       continue;
     }
-    if (strcmp(t->children[i]->contents, "}") == 0)
+
+    /* Wait for a free worker */
+    int status;
+    while (running >= workers && wait(&status) > 0)
     {
-      continue;
+      running--;
+      failed += !WIFEXITED(status) || WEXITSTATUS(status) != 0;
     }
-    if (strcmp(t->children[i]->tag, "regex") == 0)
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0)
     {
+      printf("Could not fork for %s\n", line);
+      failed++;
       continue;
     }
-    x = lval_add(x, lval_read(t->children[i]));
+    if (pid == 0)
+    {
+      /* Only what this script does counts towards its exit status */
+      limits_refill();
+      Limits.hit = 0;
+      unsigned long errors = LoadErrors;
+      lval *x = builtin_load(e, lval_add(lval_sexpr(), lval_str(line)));
+
+      /* Forms that failed were printed as they ran, which leaves a file load couldn't read */
+      int code = x->type == LVAL_ERR || LoadErrors != errors || Limits.hit;
+      if (x->type == LVAL_ERR)
+      {
+        lval_println(x);
+      }
+      fflush(stdout);
+      _exit(code);
+    }
+    running++;
   }
 
-  return x;
+  int status;
+  while (running > 0 && wait(&status) > 0)
+  {
+    running--;
+    failed += !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+  }
+  if (failed)
+  {
+    fprintf(stderr, "%i scripts failed\n", failed);
+  }
+  return failed;
+}
+
+#else
+
+void serve(lenv *e, char *path)
+{
+  printf("--serve needs Unix domain sockets\n");
+}
+
+int fork_server(lenv *e, int workers)
+{
+  printf("--fork-server needs fork\n");
+  return 1;
 }
 
+#endif
+
 int main(int argc, char **argv)
 {
-  Number = mpc_new("number");
-  Boolean = mpc_new("boolean");
-  Symbol = mpc_new("symbol");
-  Sexpr = mpc_new("sexpr");
-  Qexpr = mpc_new("qexpr");
-  Expr = mpc_new("expr");
-  NotLispy = mpc_new("notlispy");
-  String = mpc_new("string");
-  Comment = mpc_new("comment");
+  grammar_new();
+  grammar_build();
 
-  /* Define them with the following Language */
-  mpca_lang(MPCA_LANG_DEFAULT,
-            " boolean      : /true|false/ ;"
-            " string       : /\"(\\\\.|[^\"])*\"/ ;"
-            " comment      : /;[^\\r\\n]*/ ;"
-            " number       : /[+-]?([0-9]*[.])?[0-9]+/ ;"
-            " symbol       : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&|]+/ ;"
-            " sexpr        : '(' <expr>* ')' ;"
-            " qexpr        : '{' <expr>* '}' ;"
-            " expr         : <comment> | <string> | <boolean> | <number> | <symbol> | <sexpr> | <qexpr>;"
-            " notlispy     : /^/ <expr>* /$/ ;   ",
-            Comment, String, Boolean, Number, Symbol, Sexpr, Qexpr, Expr, NotLispy);
+  Arena = mpc_arena_new();
+  mpc_ast_arena(Arena);
 
   lenv *e = lenv_new();
   lenv_add_builtins(e);
 
+  /* Set when a --bench file or a --fork-server script fails */
+  int failed = 0;
+
+#ifndef _WIN32
+  /* Keep stdout for the JSON of --bench, and send what the programs print to stderr */
+  for (int i = 1; i < argc; i++)
+  {
+    if (strcmp(argv[i], "--bench") == 0)
+    {
+      fflush(stdout);
+      BenchStdout = fdopen(dup(STDOUT_FILENO), "w");
+      dup2(STDERR_FILENO, STDOUT_FILENO);
+      break;
+    }
+  }
+#endif
+
   if (argc == 1)
   {
-    puts("Not Lispy Version 0.0.0.1.0");
+    puts("Not Lispy Version " NOTLISP_VERSION);
     puts("Press Ctrl+c to Exit\n");
 
     while (1)
@@ -1401,16 +5378,21 @@ int main(int argc, char **argv)
       mpc_result_t r;
       if (mpc_parse("<stdin>", input, NotLispy, &r))
       {
-        lval *x = lval_eval(e, lval_read(r.output));
+        lval *x = lval_read(r.output);
+        mpc_arena_clear(Arena);
+
+        long long start = now_ns();
+        x = lval_eval(e, x);
+        metrics_eval(now_ns() - start);
         lval_println(x);
         lval_del(x);
-        mpc_ast_delete(r.output);
       }
       else
       {
         /* Otherwise print and delete the Error */
         mpc_err_print(r.error);
         mpc_err_delete(r.error);
+        mpc_arena_clear(Arena);
       }
 
       free(input);
@@ -1423,6 +5405,136 @@ int main(int argc, char **argv)
     /* loop over each supplied filename (starting from 1) */
     for (int i = 1; i < argc; i++)
     {
+      if (strcmp(argv[i], "--parse-bench") == 0 && i + 1 < argc)
+      {
+        bench_parse(argv[++i]);
+        continue;
+      }
+
+      if (strcmp(argv[i], "--bench") == 0 && i + 1 < argc)
+      {
+        failed |= bench_file(e, argv[++i]);
+        continue;
+      }
+
+      if (strcmp(argv[i], "--startup-bench") == 0 && i + 1 < argc)
+      {
+        bench_startup(argv[++i]);
+        continue;
+      }
+
+      if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc)
+      {
+        ProfileFile = argv[++i];
+        prof_start();
+        continue;
+      }
+
+      if (strcmp(argv[i], "--metrics") == 0 && i + 1 < argc)
+      {
+        MetricsFile = argv[++i];
+        metrics_start();
+        continue;
+      }
+
+      if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+      {
+        trace_start(argv[++i]);
+        continue;
+      }
+
+      if (strcmp(argv[i], "--lookup-stats") == 0)
+      {
+        LookupStats = 1;
+        continue;
+      }
+
+      if (strcmp(argv[i], "--alloc-stats") == 0)
+      {
+        AllocStats = 1;
+        continue;
+      }
+
+      if (strcmp(argv[i], "--call-stats") == 0)
+      {
+        CallStats = 1;
+        continue;
+      }
+
+      if (strcmp(argv[i], "--max-steps") == 0 && i + 1 < argc)
+      {
+        Limits.steps = atol(argv[++i]);
+        limits_refill();
+        continue;
+      }
+
+      if (strcmp(argv[i], "--max-heap") == 0 && i + 1 < argc)
+      {
+        if (!limits_size(argv[++i], &Limits.heap))
+        {
+          fprintf(stderr, "usage: --max-heap <bytes>[K|M|G], got '%s'\n", argv[i]);
+          return 2;
+        }
+        limits_refill();
+        continue;
+      }
+
+      if (strcmp(argv[i], "--max-depth") == 0 && i + 1 < argc)
+      {
+        Limits.max_depth = atoi(argv[++i]);
+        continue;
+      }
+
+      if (strcmp(argv[i], "--no-cache") == 0)
+      {
+        LoadCache = 0;
+        continue;
+      }
+
+      if (strcmp(argv[i], "--lazy") == 0)
+      {
+        LoadLazy = 1;
+        continue;
+      }
+
+      if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc)
+      {
+        serve(e, argv[++i]);
+        continue;
+      }
+
+      if (strcmp(argv[i], "--fork-server") == 0 && i + 1 < argc)
+      {
+        failed |= fork_server(e, atoi(argv[++i])) != 0;
+        continue;
+      }
+
+      if (strcmp(argv[i], "--save-image") == 0 && i + 1 < argc)
+      {
+        lval *x = image_save(e, argv[++i]);
+        if (x->type == LVAL_ERR)
+        {
+          lval_println(x);
+        }
+        lval_del(x);
+        continue;
+      }
+
+      if (strcmp(argv[i], "--load-image") == 0 && i + 1 < argc)
+      {
+        /* The image brings its own modules; those required so far go with e */
+        int required = Modules.count;
+        lenv *image = image_load(argv[++i]);
+        if (image == NULL)
+        {
+          printf("Could not load image %s\n", argv[i]);
+          continue;
+        }
+        lenv_del(e);
+        modules_drop(required);
+        e = image;
+        continue;
+      }
 
       /* Argument list with a single argument, the filename */
       lval *args = lval_add(lval_sexpr(), lval_str(argv[i]));
@@ -1439,7 +5551,49 @@ int main(int argc, char **argv)
     }
   }
 
+  if (ProfileFile)
+  {
+    prof_write(ProfileFile);
+  }
+  prof_del();
+  if (CallStats)
+  {
+    lbuf b = {NULL, 0, 0};
+    calls_report(&b);
+    fwrite(b.data, 1, b.len, stderr);
+    lfree(b.data);
+  }
+  if (MetricsFile)
+  {
+    metrics_write();
+  }
+  if (LookupStats)
+  {
+    lookup_report(stderr);
+  }
+  if (Trace.on)
+  {
+    trace_write();
+  }
+  trace_del();
+  calls_del();
+  metrics_del();
+  global_cache_del();
+  modules_del();
   lenv_del(e);
-  mpc_cleanup(9, String, Comment, Boolean, Number, Symbol, Sexpr, Qexpr, Expr, NotLispy);
-  return 0;
+  mpc_arena_delete(Arena);
+  grammar_delete();
+  lfree(PrintBuf.data);
+  lfree(BenchOut.data);
+  if (BenchStdout)
+  {
+    fclose(BenchStdout);
+  }
+
+  /* Last, so what is still live is what leaked */
+  if (AllocStats)
+  {
+    heap_report(stderr);
+  }
+  return Limits.hit || failed;
 }